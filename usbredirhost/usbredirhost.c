@@ -27,6 +27,11 @@
 #include <errno.h>
 #include <unistd.h>
 #include <inttypes.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 #include "usbredirhost.h"
 
 #define MAX_ENDPOINTS        32
@@ -41,6 +46,34 @@
 #define INTERRUPT_TRANSFER_COUNT   5
 /* Special packet_idx value indicating a submitted transfer */
 #define SUBMITTED_IDX             -1
+/* Special packet_idx value indicating an input stream transfer waiting for
+   the usb-guest to grant credits, see usbredirhost_ep_credits */
+#define PAUSED_IDX                -2
+/* Max number of chunk transfers of chunked bulk packets in flight, reading
+   from the usb-guest waits while there are this many, see usbredirhost_read.
+   Together with the chunk the parser is receiving, this bounds the memory
+   used for large bulk out packets to about
+   (MAX_CHUNKS_IN_FLIGHT + 1) * USBREDIRPARSER_BULK_CHUNK_SIZE bytes */
+#define MAX_CHUNKS_IN_FLIGHT       8
+/* How long to wait for chunk transfers to complete per libusb events call */
+#define CHUNK_WAIT_USEC         2500
+
+/* The rate at which the usb-guest connection drains our write queue gets
+   measured over windows of this many usec */
+#define DRAIN_WINDOW           20000
+/* Latency bounds (usec) of input stream data sitting in our write queue */
+#define ISO_LATENCY_MIN        20000
+#define ISO_LATENCY_MAX       200000
+#define INTERRUPT_LATENCY_MIN  20000
+#define INTERRUPT_LATENCY_MAX 250000
+#define BULK_LATENCY          500000
+#define THROUGHPUT_LATENCY   1000000
+
+/* Default per endpoint type weights of data written to the usb-guest, see
+   usbredirhost_set_write_weight */
+#define ISO_WRITE_WEIGHT           4
+#define INTERRUPT_WRITE_WEIGHT     4
+#define BULK_WRITE_WEIGHT          1
 
 /* quirk flags */
 #define QUIRK_DO_NOT_RESET    0x01
@@ -65,15 +98,29 @@
 #define FLUSH(host) \
     do { \
         if ((host)->flush_writes_func) \
-            (host)->flush_writes_func((host)->func_priv); \
+            usbredirhost_flush(host); \
     } while (0)
 
+/* The transfers of a bulk out packet received in chunks (one per chunk) share
+   this, so that a single status gets sent for the packet once all of them
+   have completed, see usbredirhost_bulk_packet_chunk */
+struct usbredirhost_chunked {
+    uint64_t id;
+    struct usb_redir_bulk_packet_header bulk_packet;
+    int refcount; /* Transfers in flight, + 1 while still receiving chunks */
+    uint32_t actual_length;
+    uint8_t status;
+    uint8_t cancelled;
+};
+
 struct usbredirtransfer {
     struct usbredirhost *host;        /* Back pointer to the the redirhost */
     struct libusb_transfer *transfer; /* Back pointer to the libusb transfer */
     uint64_t id;
     uint8_t cancelled;
+    uint8_t packet_buf; /* buffer is from usbredirparser_alloc_packet_buffer */
     int packet_idx;
+    struct usbredirhost_chunked *chunked;
     union {
         struct usb_redir_control_packet_header control_packet;
         struct usb_redir_bulk_packet_header bulk_packet;
@@ -82,6 +129,9 @@ struct usbredirtransfer {
     };
     struct usbredirtransfer *next;
     struct usbredirtransfer *prev;
+    /* Per endpoint list of pending control / bulk / interrupt transfers */
+    struct usbredirtransfer *ep_next;
+    struct usbredirtransfer *ep_prev;
 };
 
 struct usbredirhost_ep {
@@ -92,10 +142,15 @@ struct usbredirhost_ep {
     uint8_t stream_started;
     uint8_t pkts_per_transfer;
     uint8_t transfer_count;
+    uint8_t flow_control; /* The usb-guest has granted credits */
     int out_idx;
     int drop_packets;
     int max_packetsize;
+    uint32_t max_latency; /* usec, 0 for no limit, see set_max_latency */
+    int64_t credits; /* Minus those reserved by submitted transfers */
     struct usbredirtransfer *transfer[MAX_TRANSFER_COUNT];
+    struct usbredirtransfer *transfers_head;
+    struct usbredirtransfer *transfers_tail;
 };
 
 struct usbredirhost {
@@ -103,13 +158,19 @@ struct usbredirhost {
 
     void *lock;
     void *disconnect_lock;
+    void *batch_lock;
 
     usbredirparser_log log_func;
     usbredirparser_read read_func;
     usbredirparser_write write_func;
+    usbredirparser_writev writev_func;
     usbredirhost_flush_writes flush_writes_func;
+    usbredirparser_alloc_mem alloc_mem_func;
+    usbredirparser_realloc_mem realloc_mem_func;
+    usbredirparser_free_mem free_mem_func;
     void *func_priv;
     int verbose;
+    int flags;
     libusb_context *ctx;
     libusb_device *dev;
     libusb_device_handle *handle;
@@ -124,11 +185,43 @@ struct usbredirhost {
     int cancels_pending;
     int wait_disconnect;
     int connect_pending;
+    int batch_depth; /* Nesting level of begin_batch calls */
+    int flush_pending; /* A flush was deferred until the batch ends */
+    int write_weight[4]; /* Per endpoint type, see set_write_weight */
     struct usbredirhost_ep endpoint[MAX_ENDPOINTS];
     uint8_t alt_setting[MAX_INTERFACES];
     struct usbredirtransfer transfers_head;
+    struct usbredirtransfer *transfers_tail;
+    /* Open addressing hash of the transfers list by id, transfers which did
+       not fit (out of memory) are counted in transfers_unhashed */
+    struct usbredirtransfer **transfer_hash;
+    int transfer_hash_size; /* 0 or a power of 2 */
+    int transfer_hash_count;
+    int transfers_unhashed;
+    /* Completed control / bulk / interrupt transfers kept for re-use, the
+       amount kept is limited to the peak number of these in flight */
+    struct usbredirtransfer *free_transfers;
+    int free_transfer_count;
+    int transfers_in_flight;
+    int transfers_peak;
+    /* Iso out transfer the parser is storing a packet's data in, see
+       usbredirhost_place_packet_data */
+    struct usbredirtransfer *iso_out_placed;
+    uint8_t *iso_out_placed_data;
+    /* Chunked bulk packet being received, see usbredirhost_bulk_packet_chunk */
+    struct usbredirhost_chunked *chunked_cur;
+    int chunks_in_flight; /* Chunk transfers submitted, not yet completed */
     struct usbredirfilter_rule *filter_rules;
     int filter_rules_count;
+    /* Drain rate measurement, see usbredirhost_account_write, these are
+       written with the parser write lock held rather then the host lock,
+       readers only use them as an estimate */
+    uint64_t drain_start;
+    uint64_t drain_last;
+    uint64_t drain_progress; /* Time of the last write which wrote data */
+    uint64_t drain_bytes;
+    uint8_t drain_blocked;
+    uint32_t drain_rate; /* bytes / sec, 0 when not known yet */
 };
 
 struct usbredirhost_dev_ids {
@@ -201,18 +294,27 @@ static void usbredirhost_start_bulk_receiving(void *priv, uint64_t id,
     struct usb_redir_start_bulk_receiving_header *start_bulk_receiving);
 static void usbredirhost_stop_bulk_receiving(void *priv, uint64_t id,
     struct usb_redir_stop_bulk_receiving_header *stop_bulk_receiving);
+static void usbredirhost_ep_credits(void *priv, uint64_t id,
+    struct usb_redir_ep_credits_header *ep_credits);
 static void usbredirhost_control_packet(void *priv, uint64_t id,
     struct usb_redir_control_packet_header *control_packet,
     uint8_t *data, int data_len);
 static void usbredirhost_bulk_packet(void *priv, uint64_t id,
     struct usb_redir_bulk_packet_header *bulk_packet,
     uint8_t *data, int data_len);
+static void usbredirhost_bulk_packet_chunk(void *priv, uint64_t id,
+    struct usb_redir_bulk_packet_header *bulk_packet,
+    uint8_t *data, int data_len, int offset, int last);
 static void usbredirhost_iso_packet(void *priv, uint64_t id,
     struct usb_redir_iso_packet_header *iso_packet,
     uint8_t *data, int data_len);
 static void usbredirhost_interrupt_packet(void *priv, uint64_t id,
     struct usb_redir_interrupt_packet_header *interrupt_packet,
     uint8_t *data, int data_len);
+static uint8_t *usbredirhost_place_packet_data(void *priv, uint64_t id,
+    int type, void *type_header, int data_len);
+static int usbredirhost_put_iso_out_placed_unlocked(struct usbredirhost *host,
+    uint8_t *data);
 
 static void LIBUSB_CALL usbredirhost_iso_packet_complete(
     struct libusb_transfer *libusb_transfer);
@@ -220,6 +322,8 @@ static void LIBUSB_CALL usbredirhost_buffered_packet_complete(
     struct libusb_transfer *libusb_transfer);
 static int usbredirhost_cancel_pending_urbs(struct usbredirhost *host);
 static void usbredirhost_clear_device(struct usbredirhost *host);
+static void usbredirhost_free_transfer_pool(struct usbredirhost *host);
+static void usbredirhost_flush(struct usbredirhost *host);
 
 static void usbredirhost_log(void *priv, int level, const char *msg)
 {
@@ -228,9 +332,32 @@ static void usbredirhost_log(void *priv, int level, const char *msg)
     host->log_func(host->func_priv, level, msg);
 }
 
+/* Chunks of large bulk out packets get submitted as soon as they have been
+   received, when the device is slower than the connection to the usb-guest,
+   stop reading further chunks until some of those in flight complete */
+static void usbredirhost_wait_for_chunks(struct usbredirhost *host)
+{
+    struct timeval tv;
+    int wait;
+
+    for (;;) {
+        LOCK(host);
+        wait = host->chunks_in_flight >= MAX_CHUNKS_IN_FLIGHT &&
+               !host->disconnected;
+        UNLOCK(host);
+        if (!wait) {
+            break;
+        }
+        memset(&tv, 0, sizeof(tv));
+        tv.tv_usec = CHUNK_WAIT_USEC;
+        libusb_handle_events_timeout(host->ctx, &tv);
+    }
+}
+
 static int usbredirhost_read(void *priv, uint8_t *data, int count)
 {
     struct usbredirhost *host = priv;
+    int r;
 
     if (host->read_status) {
         int ret = host->read_status;
@@ -238,14 +365,105 @@ static int usbredirhost_read(void *priv, uint8_t *data, int count)
         return ret;
     }
 
-    return host->read_func(host->func_priv, data, count);
+    /* This only gets called from usbredirhost_read_guest_data, close its
+       batch while reading, as read_func may block, and flushes from other
+       threads would be deferred meanwhile */
+    usbredirhost_end_batch(host);
+    usbredirhost_wait_for_chunks(host);
+    r = host->read_func(host->func_priv, data, count);
+    usbredirhost_begin_batch(host);
+    return r;
+}
+
+/* Monotonic time in microseconds */
+static uint64_t usbredirhost_time(void)
+{
+#ifdef WIN32
+    return (uint64_t)GetTickCount64() * 1000;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/* Measure the rate at which the connection to the usb-guest drains our write
+   queue. Gaps between writes after the transport accepted all we had are
+   idle time and restart the measurement window.
+   Note this gets called with the parser write lock held */
+static void usbredirhost_account_write(struct usbredirhost *host,
+    int count, int written)
+{
+    uint64_t now = usbredirhost_time();
+    uint64_t rate;
+
+    if (!host->drain_blocked && now - host->drain_last > DRAIN_WINDOW) {
+        host->drain_start = now;
+        host->drain_bytes = 0;
+    }
+    host->drain_last = now;
+    host->drain_blocked = written < count;
+    if (written > 0) {
+        host->drain_bytes += written;
+        host->drain_progress = now;
+    }
+
+    if (now - host->drain_start >= DRAIN_WINDOW) {
+        rate = host->drain_bytes * 1000000 / (now - host->drain_start);
+        if (host->drain_rate) {
+            rate = (3 * (uint64_t)host->drain_rate + rate) / 4;
+        }
+        host->drain_rate = (rate > UINT32_MAX) ? UINT32_MAX : rate;
+        host->drain_start = now;
+        host->drain_bytes = 0;
+    }
 }
 
 static int usbredirhost_write(void *priv, uint8_t *data, int count)
 {
     struct usbredirhost *host = priv;
+    int w;
+
+    w = host->write_func(host->func_priv, data, count);
+    usbredirhost_account_write(host, count, w);
+    return w;
+}
+
+static int usbredirhost_writev(void *priv,
+    const struct usbredirparser_iovec *iov, int iovcnt)
+{
+    struct usbredirhost *host = priv;
+    int i, w, count = 0;
 
-    return host->write_func(host->func_priv, data, count);
+    for (i = 0; i < iovcnt; i++) {
+        count += iov[i].iov_len;
+    }
+    w = host->writev_func(host->func_priv, iov, iovcnt);
+    usbredirhost_account_write(host, count, w);
+    return w;
+}
+
+static void *usbredirhost_alloc_mem(void *priv, size_t size, int type)
+{
+    struct usbredirhost *host = priv;
+
+    return host->alloc_mem_func(host->func_priv, size, type);
+}
+
+static void *usbredirhost_realloc_mem(void *priv, void *ptr, size_t size,
+    int type)
+{
+    struct usbredirhost *host = priv;
+
+    return host->realloc_mem_func(host->func_priv, ptr, size, type);
+}
+
+static void usbredirhost_free_mem(void *priv, void *ptr)
+{
+    struct usbredirhost *host = priv;
+
+    host->free_mem_func(host->func_priv, ptr);
 }
 
 /* Can be called both from parser read callbacks as well as from libusb
@@ -407,15 +625,17 @@ static void usbredirhost_parse_interface(struct usbredirhost *host, int i)
 {
     int j;
     const struct libusb_interface_descriptor *intf_desc;
-    uint8_t ep_address;
+    uint8_t ep_address, type;
 
     intf_desc =
         &host->config->interface[i].altsetting[host->alt_setting[i]];
 
     for (j = 0; j < intf_desc->bNumEndpoints; j++) {
         ep_address = intf_desc->endpoint[j].bEndpointAddress;
-        host->endpoint[EP2I(ep_address)].type =
-            intf_desc->endpoint[j].bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+        type = intf_desc->endpoint[j].bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+        host->endpoint[EP2I(ep_address)].type = type;
+        usbredirparser_set_write_weight(host->parser, ep_address,
+                                        host->write_weight[type]);
         host->endpoint[EP2I(ep_address)].interval =
             intf_desc->endpoint[j].bInterval;
         host->endpoint[EP2I(ep_address)].interface =
@@ -615,9 +835,35 @@ struct usbredirhost *usbredirhost_open_full(
     usbredirparser_unlock unlock_func,
     usbredirparser_free_lock free_lock_func,
     void *func_priv, const char *version, int verbose, int flags)
+{
+    return usbredirhost_open_full_alloc(usb_ctx, usb_dev_handle, log_func,
+                                        read_guest_data_func,
+                                        write_guest_data_func,
+                                        flush_writes_func, alloc_lock_func,
+                                        lock_func, unlock_func,
+                                        free_lock_func, NULL, NULL, NULL,
+                                        func_priv, version, verbose, flags);
+}
+
+struct usbredirhost *usbredirhost_open_full_alloc(
+    libusb_context *usb_ctx,
+    libusb_device_handle *usb_dev_handle,
+    usbredirparser_log log_func,
+    usbredirparser_read  read_guest_data_func,
+    usbredirparser_write write_guest_data_func,
+    usbredirhost_flush_writes flush_writes_func,
+    usbredirparser_alloc_lock alloc_lock_func,
+    usbredirparser_lock lock_func,
+    usbredirparser_unlock unlock_func,
+    usbredirparser_free_lock free_lock_func,
+    usbredirparser_alloc_mem alloc_mem_func,
+    usbredirparser_realloc_mem realloc_mem_func,
+    usbredirparser_free_mem free_mem_func,
+    void *func_priv, const char *version, int verbose, int flags)
 {
     struct usbredirhost *host;
-    int parser_flags = usbredirparser_fl_usb_host;
+    int parser_flags = usbredirparser_fl_usb_host |
+                       usbredirparser_fl_borrow_packet_data;
     uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
 
     host = calloc(1, sizeof(*host));
@@ -633,9 +879,17 @@ struct usbredirhost *usbredirhost_open_full(
     host->read_func = read_guest_data_func;
     host->write_func = write_guest_data_func;
     host->flush_writes_func = flush_writes_func;
+    host->alloc_mem_func = alloc_mem_func;
+    host->realloc_mem_func = realloc_mem_func;
+    host->free_mem_func = free_mem_func;
     host->func_priv = func_priv;
     host->verbose = verbose;
     host->disconnected = 1; /* No device is connected initially */
+    host->transfers_tail = &host->transfers_head;
+    host->write_weight[usb_redir_type_control] = 1;
+    host->write_weight[usb_redir_type_iso] = ISO_WRITE_WEIGHT;
+    host->write_weight[usb_redir_type_bulk] = BULK_WRITE_WEIGHT;
+    host->write_weight[usb_redir_type_interrupt] = INTERRUPT_WRITE_WEIGHT;
     host->parser = usbredirparser_create();
     if (!host->parser) {
         log_func(func_priv, usbredirparser_error,
@@ -670,23 +924,36 @@ struct usbredirhost *usbredirhost_open_full(
         usbredirhost_start_bulk_receiving;
     host->parser->stop_bulk_receiving_func =
         usbredirhost_stop_bulk_receiving;
+    host->parser->ep_credits_func = usbredirhost_ep_credits;
     host->parser->control_packet_func = usbredirhost_control_packet;
     host->parser->bulk_packet_func = usbredirhost_bulk_packet;
+    host->parser->bulk_packet_chunk_func = usbredirhost_bulk_packet_chunk;
     host->parser->iso_packet_func = usbredirhost_iso_packet;
     host->parser->interrupt_packet_func = usbredirhost_interrupt_packet;
+    host->parser->place_packet_data_func = usbredirhost_place_packet_data;
     host->parser->alloc_lock_func = alloc_lock_func;
     host->parser->lock_func = lock_func;
     host->parser->unlock_func = unlock_func;
     host->parser->free_lock_func = free_lock_func;
+    if (alloc_mem_func && realloc_mem_func && free_mem_func) {
+        host->parser->alloc_mem_func = usbredirhost_alloc_mem;
+        host->parser->realloc_mem_func = usbredirhost_realloc_mem;
+        host->parser->free_mem_func = usbredirhost_free_mem;
+    }
 
     if (host->parser->alloc_lock_func) {
         host->lock = host->parser->alloc_lock_func();
         host->disconnect_lock = host->parser->alloc_lock_func();
+        host->batch_lock = host->parser->alloc_lock_func();
     }
 
+    host->flags = flags;
     if (flags & usbredirhost_fl_write_cb_owns_buffer) {
         parser_flags |= usbredirparser_fl_write_cb_owns_buffer;
     }
+    if (flags & usbredirhost_fl_buffer_pool) {
+        parser_flags |= usbredirparser_fl_buffer_pool;
+    }
 
     usbredirparser_caps_set_cap(caps, usb_redir_cap_connect_device_version);
     usbredirparser_caps_set_cap(caps, usb_redir_cap_filter);
@@ -695,6 +962,12 @@ struct usbredirhost *usbredirhost_open_full(
     usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
     usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
     usbredirparser_caps_set_cap(caps, usb_redir_cap_bulk_receiving);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_compact_header);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_ep_credits);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_multi_iso_packets);
+    if (flags & usbredirhost_fl_compression) {
+        usbredirparser_caps_set_cap(caps, usb_redir_cap_compression);
+    }
 
     usbredirparser_init(host->parser, version, caps, USB_REDIR_CAPS_SIZE,
                         parser_flags);
@@ -721,9 +994,14 @@ void usbredirhost_close(struct usbredirhost *host)
     if (host->disconnect_lock) {
         host->parser->free_lock_func(host->disconnect_lock);
     }
+    if (host->batch_lock) {
+        host->parser->free_lock_func(host->batch_lock);
+    }
     if (host->parser) {
         usbredirparser_destroy(host->parser);
     }
+    free(host->chunked_cur);
+    free(host->transfer_hash);
     free(host->filter_rules);
     free(host);
 }
@@ -799,12 +1077,22 @@ static void usbredirhost_clear_device(struct usbredirhost *host)
     while (wait) {
         memset(&tv, 0, sizeof(tv));
         tv.tv_usec = 2500;
+        usbredirhost_begin_batch(host);
         libusb_handle_events_timeout(host->ctx, &tv);
+        usbredirhost_end_batch(host);
         LOCK(host);
         wait = host->cancels_pending || host->transfers_head.next;
         UNLOCK(host);
     }
 
+    usbredirhost_free_transfer_pool(host);
+    LOCK(host);
+    usbredirhost_put_iso_out_placed_unlocked(host, NULL);
+    /* Don't submit any further chunks of a chunked packet to a new device */
+    if (host->chunked_cur && host->chunked_cur->status == usb_redir_success)
+        host->chunked_cur->status = usb_redir_ioerror;
+    UNLOCK(host);
+
     usbredirhost_release(host, 1);
 
     if (host->config) {
@@ -826,7 +1114,69 @@ static void usbredirhost_clear_device(struct usbredirhost *host)
 
 int usbredirhost_read_guest_data(struct usbredirhost *host)
 {
-    return usbredirparser_do_read(host->parser);
+    int r;
+
+    /* Flush once for all packets handled per read, rather then once per
+       reply, see usbredirhost_read */
+    usbredirhost_begin_batch(host);
+    r = usbredirparser_do_read(host->parser);
+    usbredirhost_end_batch(host);
+    return r;
+}
+
+/* Batches use their own lock, as FLUSH gets called both with and without
+   the host lock held */
+static void usbredirhost_flush(struct usbredirhost *host)
+{
+    int batched;
+
+    if (host->batch_lock) {
+        host->parser->lock_func(host->batch_lock);
+    }
+    batched = host->batch_depth > 0;
+    if (batched) {
+        host->flush_pending = 1;
+    }
+    if (host->batch_lock) {
+        host->parser->unlock_func(host->batch_lock);
+    }
+
+    if (!batched) {
+        host->flush_writes_func(host->func_priv);
+    }
+}
+
+void usbredirhost_begin_batch(struct usbredirhost *host)
+{
+    if (host->batch_lock) {
+        host->parser->lock_func(host->batch_lock);
+    }
+    host->batch_depth++;
+    if (host->batch_lock) {
+        host->parser->unlock_func(host->batch_lock);
+    }
+}
+
+void usbredirhost_end_batch(struct usbredirhost *host)
+{
+    int flush = 0;
+
+    if (host->batch_lock) {
+        host->parser->lock_func(host->batch_lock);
+    }
+    if (host->batch_depth == 0) {
+        ERROR("error usbredirhost_end_batch called without a batch");
+    } else if (--host->batch_depth == 0) {
+        flush = host->flush_pending;
+        host->flush_pending = 0;
+    }
+    if (host->batch_lock) {
+        host->parser->unlock_func(host->batch_lock);
+    }
+
+    if (flush) {
+        FLUSH(host);
+    }
 }
 
 int usbredirhost_has_data_to_write(struct usbredirhost *host)
@@ -844,6 +1194,48 @@ void usbredirhost_free_write_buffer(struct usbredirhost *host, uint8_t *data)
     usbredirparser_free_write_buffer(host->parser, data);
 }
 
+void usbredirhost_set_writev_func(struct usbredirhost *host,
+    usbredirparser_writev writev_guest_data_func)
+{
+    host->writev_func = writev_guest_data_func;
+    host->parser->writev_func =
+        writev_guest_data_func ? usbredirhost_writev : NULL;
+}
+
+void usbredirhost_set_packet_ttl(struct usbredirhost *host, int ep_type,
+    uint32_t ttl)
+{
+    usbredirparser_set_packet_ttl(host->parser, ep_type, ttl);
+}
+
+uint64_t usbredirhost_get_expired_packets(struct usbredirhost *host,
+    int ep_type)
+{
+    return usbredirparser_get_expired_packets(host->parser, ep_type);
+}
+
+void usbredirhost_set_write_weight(struct usbredirhost *host, int ep_type,
+    int weight)
+{
+    int i;
+
+    if (ep_type < usb_redir_type_control ||
+            ep_type > usb_redir_type_interrupt || weight < 1 ||
+            weight > 256) {
+        ERROR("error invalid write weight %d for endpoint type %d",
+              weight, ep_type);
+        return;
+    }
+
+    LOCK(host);
+    host->write_weight[ep_type] = weight;
+    for (i = 0; i < MAX_ENDPOINTS; i++) {
+        if (host->endpoint[i].type == ep_type)
+            usbredirparser_set_write_weight(host->parser, I2EP(i), weight);
+    }
+    UNLOCK(host);
+}
+
 /**************************************************************************/
 
 static struct usbredirtransfer *usbredirhost_alloc_transfer(
@@ -867,30 +1259,237 @@ static struct usbredirtransfer *usbredirhost_alloc_transfer(
     return redir_transfer;
 }
 
+static void usbredirhost_free_transfer_buffer(
+    struct usbredirtransfer *transfer)
+{
+    /* All transfer buffers are allocated through the parser, either by
+       usbredirparser_alloc_packet_buffer, usbredirparser_alloc_packet_data
+       or as received packet data */
+    if (transfer->packet_buf)
+        usbredirparser_free_packet_buffer(transfer->host->parser,
+                                          transfer->transfer->buffer);
+    else
+        usbredirparser_free_packet_data(transfer->host->parser,
+                                        transfer->transfer->buffer);
+    transfer->transfer->buffer = NULL;
+}
+
 static void usbredirhost_free_transfer(struct usbredirtransfer *transfer)
 {
     if (!transfer)
         return;
 
-    /* In certain cases this should really be a usbredirparser_free_packet_data
-       but since we use the same malloc impl. as usbredirparser this is ok. */
-    free(transfer->transfer->buffer);
+    usbredirhost_free_transfer_buffer(transfer);
     libusb_free_transfer(transfer->transfer);
     free(transfer);
 }
 
+/* Get a transfer for a single control / bulk / interrupt packet, re-using
+   a previously completed one when available. */
+static struct usbredirtransfer *usbredirhost_get_transfer(
+    struct usbredirhost *host)
+{
+    struct usbredirtransfer *transfer;
+
+    LOCK(host);
+    transfer = host->free_transfers;
+    if (transfer) {
+        host->free_transfers = transfer->next;
+        host->free_transfer_count--;
+        transfer->next = NULL;
+    }
+    host->transfers_in_flight++;
+    if (host->transfers_in_flight > host->transfers_peak)
+        host->transfers_peak = host->transfers_in_flight;
+    UNLOCK(host);
+
+    if (!transfer) {
+        transfer = usbredirhost_alloc_transfer(host, 0);
+        if (!transfer) {
+            LOCK(host);
+            host->transfers_in_flight--;
+            UNLOCK(host);
+        }
+    }
+    return transfer;
+}
+
+/* Note caller must hold the host lock */
+static void usbredirhost_put_transfer(struct usbredirtransfer *transfer)
+{
+    struct usbredirhost *host = transfer->host;
+    struct libusb_transfer *libusb_transfer = transfer->transfer;
+
+    host->transfers_in_flight--;
+    if (host->free_transfer_count >= host->transfers_peak) {
+        usbredirhost_free_transfer(transfer);
+        return;
+    }
+
+    usbredirhost_free_transfer_buffer(transfer);
+    memset(transfer, 0, sizeof(*transfer));
+    transfer->host = host;
+    transfer->transfer = libusb_transfer;
+
+    transfer->next = host->free_transfers;
+    host->free_transfers = transfer;
+    host->free_transfer_count++;
+}
+
+static void usbredirhost_free_transfer_pool(struct usbredirhost *host)
+{
+    struct usbredirtransfer *transfer, *next;
+
+    LOCK(host);
+    transfer = host->free_transfers;
+    host->free_transfers = NULL;
+    host->free_transfer_count = 0;
+    host->transfers_peak = host->transfers_in_flight;
+    UNLOCK(host);
+
+    while (transfer) {
+        next = transfer->next;
+        usbredirhost_free_transfer(transfer);
+        transfer = next;
+    }
+}
+
+static unsigned int usbredirhost_hash_id(uint64_t id)
+{
+    return (id * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+/* Note caller must hold the host lock */
+static int usbredirhost_grow_transfer_hash(struct usbredirhost *host)
+{
+    struct usbredirtransfer **hash;
+    int i, j, size, mask;
+
+    size = host->transfer_hash_size ? host->transfer_hash_size * 2 : 64;
+    hash = calloc(size, sizeof(*hash));
+    if (!hash)
+        return -1;
+
+    mask = size - 1;
+    for (i = 0; i < host->transfer_hash_size; i++) {
+        if (!host->transfer_hash[i])
+            continue;
+        j = usbredirhost_hash_id(host->transfer_hash[i]->id) & mask;
+        while (hash[j])
+            j = (j + 1) & mask;
+        hash[j] = host->transfer_hash[i];
+    }
+
+    free(host->transfer_hash);
+    host->transfer_hash = hash;
+    host->transfer_hash_size = size;
+    return 0;
+}
+
+/* Note caller must hold the host lock */
+static void usbredirhost_hash_transfer(struct usbredirhost *host,
+    struct usbredirtransfer *transfer)
+{
+    int i, mask;
+
+    /* Keep the load factor <= 0.5, and always keep 1 free slot */
+    if ((host->transfer_hash_count + 1) * 2 > host->transfer_hash_size &&
+            usbredirhost_grow_transfer_hash(host) != 0 &&
+            host->transfer_hash_count + 1 >= host->transfer_hash_size) {
+        host->transfers_unhashed++;
+        return;
+    }
+
+    mask = host->transfer_hash_size - 1;
+    i = usbredirhost_hash_id(transfer->id) & mask;
+    while (host->transfer_hash[i])
+        i = (i + 1) & mask;
+    host->transfer_hash[i] = transfer;
+    host->transfer_hash_count++;
+}
+
+/* Note caller must hold the host lock */
+static void usbredirhost_unhash_transfer(struct usbredirhost *host,
+    struct usbredirtransfer *transfer)
+{
+    struct usbredirtransfer **hash = host->transfer_hash;
+    int i, j, k, mask = host->transfer_hash_size - 1;
+
+    if (!host->transfer_hash_size) {
+        host->transfers_unhashed--;
+        return;
+    }
+
+    i = usbredirhost_hash_id(transfer->id) & mask;
+    while (hash[i] && hash[i] != transfer)
+        i = (i + 1) & mask;
+    if (!hash[i]) {
+        host->transfers_unhashed--;
+        return;
+    }
+
+    /* Shift back any following entries which may no longer be reachable */
+    j = i;
+    for (;;) {
+        hash[i] = NULL;
+        do {
+            j = (j + 1) & mask;
+            if (!hash[j]) {
+                host->transfer_hash_count--;
+                return;
+            }
+            k = usbredirhost_hash_id(hash[j]->id) & mask;
+        } while ((i <= j) ? (i < k && k <= j) : (i < k || k <= j));
+        hash[i] = hash[j];
+        i = j;
+    }
+}
+
+/* Note caller must hold the host lock */
+static struct usbredirtransfer *usbredirhost_find_transfer(
+    struct usbredirhost *host, uint64_t id)
+{
+    struct usbredirtransfer *t;
+    int i, mask = host->transfer_hash_size - 1;
+
+    if (host->transfer_hash_size) {
+        i = usbredirhost_hash_id(id) & mask;
+        while (host->transfer_hash[i]) {
+            if (host->transfer_hash[i]->id == id)
+                return host->transfer_hash[i];
+            i = (i + 1) & mask;
+        }
+    }
+
+    if (host->transfers_unhashed) {
+        for (t = host->transfers_head.next; t; t = t->next) {
+            if (t->id == id)
+                return t;
+        }
+    }
+
+    return NULL;
+}
+
 static void usbredirhost_add_transfer(struct usbredirhost *host,
     struct usbredirtransfer *new_transfer)
 {
-    struct usbredirtransfer *transfer = &host->transfers_head;
+    struct usbredirhost_ep *ep =
+        &host->endpoint[EP2I(new_transfer->transfer->endpoint)];
 
     LOCK(host);
-    while (transfer->next) {
-        transfer = transfer->next;
-    }
+    new_transfer->prev = host->transfers_tail;
+    host->transfers_tail->next = new_transfer;
+    host->transfers_tail = new_transfer;
+
+    new_transfer->ep_prev = ep->transfers_tail;
+    if (ep->transfers_tail)
+        ep->transfers_tail->ep_next = new_transfer;
+    else
+        ep->transfers_head = new_transfer;
+    ep->transfers_tail = new_transfer;
 
-    new_transfer->prev = transfer;
-    transfer->next = new_transfer;
+    usbredirhost_hash_transfer(host, new_transfer);
     UNLOCK(host);
 }
 
@@ -898,11 +1497,28 @@ static void usbredirhost_add_transfer(struct usbredirhost *host,
 static void usbredirhost_remove_and_free_transfer(
     struct usbredirtransfer *transfer)
 {
+    struct usbredirhost *host = transfer->host;
+    struct usbredirhost_ep *ep =
+        &host->endpoint[EP2I(transfer->transfer->endpoint)];
+
     if (transfer->next)
         transfer->next->prev = transfer->prev;
     if (transfer->prev)
         transfer->prev->next = transfer->next;
-    usbredirhost_free_transfer(transfer);
+    if (host->transfers_tail == transfer)
+        host->transfers_tail = transfer->prev;
+
+    if (transfer->ep_next)
+        transfer->ep_next->ep_prev = transfer->ep_prev;
+    else
+        ep->transfers_tail = transfer->ep_prev;
+    if (transfer->ep_prev)
+        transfer->ep_prev->ep_next = transfer->ep_next;
+    else
+        ep->transfers_head = transfer->ep_next;
+
+    usbredirhost_unhash_transfer(host, transfer);
+    usbredirhost_put_transfer(transfer);
 }
 
 /**************************************************************************/
@@ -920,6 +1536,10 @@ static void usbredirhost_cancel_stream_unlocked(struct usbredirhost *host,
             libusb_cancel_transfer(transfer->transfer);
             transfer->cancelled = 1;
             host->cancels_pending++;
+        } else if (transfer == host->iso_out_placed) {
+            /* The parser is storing packet data in it, it gets freed by
+               usbredirhost_put_iso_out_placed_unlocked */
+            transfer->cancelled = 1;
         } else {
             usbredirhost_free_transfer(transfer);
         }
@@ -930,14 +1550,39 @@ static void usbredirhost_cancel_stream_unlocked(struct usbredirhost *host,
     host->endpoint[EP2I(ep)].drop_packets = 0;
     host->endpoint[EP2I(ep)].pkts_per_transfer = 0;
     host->endpoint[EP2I(ep)].transfer_count = 0;
+    host->endpoint[EP2I(ep)].flow_control = 0;
+    host->endpoint[EP2I(ep)].credits = 0;
 }
 
-static void usbredirhost_cancel_stream(struct usbredirhost *host,
+/* Drop input stream data for ep which is still queued for writing, once
+   the stream is stopped it only delays the packets queued after it.
+   Note caller must hold the host lock */
+static void usbredirhost_purge_stream_data(struct usbredirhost *host,
     uint8_t ep)
 {
-    LOCK(host);
-    usbredirhost_cancel_stream_unlocked(host, ep);
-    UNLOCK(host);
+    int purged = 0;
+
+    if (!(ep & LIBUSB_ENDPOINT_IN))
+        return;
+
+    switch (host->endpoint[EP2I(ep)].type) {
+    case usb_redir_type_iso:
+        purged = usbredirparser_purge_write_queue(host->parser,
+                                                  usb_redir_iso_packet, ep);
+        purged += usbredirparser_purge_write_queue(host->parser,
+                                              usb_redir_multi_iso_packet, ep);
+        break;
+    case usb_redir_type_bulk:
+        purged = usbredirparser_purge_write_queue(host->parser,
+                                          usb_redir_buffered_bulk_packet, ep);
+        break;
+    case usb_redir_type_interrupt:
+        purged = usbredirparser_purge_write_queue(host->parser,
+                                              usb_redir_interrupt_packet, ep);
+        break;
+    }
+    if (purged)
+        DEBUG("purged %d queued stream packets for ep %02X", purged, ep);
 }
 
 static void usbredirhost_send_stream_status(struct usbredirhost *host,
@@ -973,21 +1618,57 @@ static void usbredirhost_send_stream_status(struct usbredirhost *host,
     }
 }
 
+static int usbredirhost_drop_stream_data(struct usbredirhost *host,
+    uint8_t ep, uint8_t status, int len)
+{
+    struct usbredirhost_ep *endp = &host->endpoint[EP2I(ep)];
+    uint64_t latency, predicted, max_latency, transfer_time;
+    uint32_t rate;
+
+    /* With flow control the usb-guest has room for all data we send */
+    if (endp->flow_control || endp->max_latency == 0)
+        return 0;
+
+    /* The oldest queued packet has been waiting this long */
+    latency = usbredirparser_get_write_buf_age(host->parser);
+    if (latency <= endp->max_latency)
+        return 0;
+
+    /* Data we queue now will wait for the queued data to drain. If the
+       connection is making progress at a known rate, only drop when this
+       is too slow too, as the oldest packet may be late because of a hiccup
+       which has passed since. */
+    max_latency = endp->max_latency;
+    rate = host->drain_rate;
+    if (rate && usbredirhost_time() - host->drain_progress < DRAIN_WINDOW) {
+        predicted = usbredirparser_get_write_buf_bytes(host->parser) *
+                    1000000 / rate;
+        if (predicted < latency)
+            latency = predicted;
+        /* Always allow enough time to send the data of a single transfer */
+        transfer_time = (uint64_t)endp->pkts_per_transfer *
+                        endp->max_packetsize * 1000000 / rate;
+        if (transfer_time > max_latency)
+            max_latency = transfer_time;
+    }
+    if (latency <= max_latency)
+        return 0;
+
+    if (endp->warn_on_drop) {
+        WARNING("buffered stream on endpoint %02X, connection too slow, "
+                "dropping packets", ep);
+        endp->warn_on_drop = 0;
+    }
+    DEBUG("buffered complete ep %02X dropping packet status %d len %d",
+          ep, status, len);
+    return 1;
+}
+
 static void usbredirhost_send_stream_data(struct usbredirhost *host,
     uint64_t id, uint8_t ep, uint8_t status, uint8_t *data, int len)
 {
-    /* USB-2 is max 8000 packets / sec, if we've queued up more then 0.1 sec,
-       assume our connection is not keeping up and start dropping packets. */
-    if (usbredirparser_has_data_to_write(host->parser) > 800) {
-        if (host->endpoint[EP2I(ep)].warn_on_drop) {
-            WARNING("buffered stream on endpoint %02X, connection too slow, "
-                    "dropping packets", ep);
-            host->endpoint[EP2I(ep)].warn_on_drop = 0;
-        }
-        DEBUG("buffered complete ep %02X dropping packet status %d len %d",
-              ep, status, len);
+    if (usbredirhost_drop_stream_data(host, ep, status, len))
         return;
-    }
 
     DEBUG("buffered complete ep %02X status %d len %d", ep, status, len);
 
@@ -1025,6 +1706,55 @@ static void usbredirhost_send_stream_data(struct usbredirhost *host,
     }
 }
 
+/* Send the data of a buffered bulk / interrupt receiving transfer. Its
+   buffer gets handed over to the parser to avoid a memcpy and is replaced
+   by a new one, if allocating that fails we fall back to copying. */
+static void usbredirhost_send_stream_transfer_data(struct usbredirhost *host,
+    struct usbredirtransfer *transfer, uint8_t status, int len)
+{
+    struct libusb_transfer *libusb_transfer = transfer->transfer;
+    uint8_t ep = libusb_transfer->endpoint;
+    uint8_t type = host->endpoint[EP2I(ep)].type;
+    uint8_t *buffer;
+
+    if (usbredirhost_drop_stream_data(host, ep, status, len))
+        return;
+
+    buffer = usbredirparser_alloc_packet_buffer(host->parser,
+                              (type == usb_redir_type_bulk) ?
+                                  usb_redir_buffered_bulk_packet :
+                                  usb_redir_interrupt_packet,
+                              libusb_transfer->length);
+    if (!buffer) {
+        usbredirhost_send_stream_data(host, transfer->id, ep, status,
+                                      libusb_transfer->buffer, len);
+        return;
+    }
+
+    DEBUG("buffered complete ep %02X status %d len %d", ep, status, len);
+
+    if (type == usb_redir_type_bulk) {
+        struct usb_redir_buffered_bulk_packet_header bulk_packet = {
+            .endpoint = ep,
+            .status   = status,
+            .length   = len,
+        };
+        usbredirparser_send_buffered_bulk_packet_buf(host->parser,
+                        transfer->id, &bulk_packet,
+                        libusb_transfer->buffer, len);
+    } else {
+        struct usb_redir_interrupt_packet_header interrupt_packet = {
+            .endpoint = ep,
+            .status   = status,
+            .length   = len,
+        };
+        usbredirparser_send_interrupt_packet_buf(host->parser,
+                        transfer->id, &interrupt_packet,
+                        libusb_transfer->buffer, len);
+    }
+    libusb_transfer->buffer = buffer;
+}
+
 /* Called from both parser read and packet complete callbacks */
 static int usbredirhost_submit_stream_transfer_unlocked(
     struct usbredirhost *host, struct usbredirtransfer *transfer)
@@ -1052,6 +1782,65 @@ static int usbredirhost_submit_stream_transfer_unlocked(
     return usb_redir_success;
 }
 
+/* The number of credits an input stream transfer uses, the usb-guest
+   grants credits per packet, for iso streams per iso packet */
+static int usbredirhost_transfer_credits(struct usbredirhost *host,
+    uint8_t ep)
+{
+    if (host->endpoint[EP2I(ep)].type == usb_redir_type_iso)
+        return host->endpoint[EP2I(ep)].pkts_per_transfer;
+    return 1;
+}
+
+/* Submit an input stream transfer, unless the usb-guest uses flow control
+   and has not granted enough credits for it, then it gets paused until it
+   does, see usbredirhost_resume_stream_unlocked.
+   Note caller must hold the host lock */
+static int usbredirhost_submit_in_stream_transfer_unlocked(
+    struct usbredirhost *host, struct usbredirtransfer *transfer)
+{
+    uint8_t ep = transfer->transfer->endpoint;
+    int credits = usbredirhost_transfer_credits(host, ep);
+
+    if (host->endpoint[EP2I(ep)].flow_control) {
+        if (host->endpoint[EP2I(ep)].credits < credits) {
+            DEBUG("out of credits on ep %02X, pausing transfer", ep);
+            transfer->packet_idx = PAUSED_IDX;
+            return usb_redir_success;
+        }
+        host->endpoint[EP2I(ep)].credits -= credits;
+    }
+    return usbredirhost_submit_stream_transfer_unlocked(host, transfer);
+}
+
+/* Submit the paused transfers of an input stream for as far as the credits
+   allow, in id order so that the data keeps arriving in order.
+   Note caller must hold the host lock */
+static void usbredirhost_resume_stream_unlocked(struct usbredirhost *host,
+    uint8_t ep)
+{
+    struct usbredirtransfer *transfer;
+    int i;
+
+    for (;;) {
+        transfer = NULL;
+        for (i = 0; i < host->endpoint[EP2I(ep)].transfer_count; i++) {
+            struct usbredirtransfer *t = host->endpoint[EP2I(ep)].transfer[i];
+            if (t->packet_idx == PAUSED_IDX &&
+                    (!transfer || t->id < transfer->id))
+                transfer = t;
+        }
+        if (!transfer || host->endpoint[EP2I(ep)].credits <
+                             usbredirhost_transfer_credits(host, ep))
+            return;
+
+        DEBUG("resuming transfer on ep %02X", ep);
+        if (usbredirhost_submit_in_stream_transfer_unlocked(host, transfer)
+                != usb_redir_success)
+            return;
+    }
+}
+
 /* Called from both parser read and packet complete callbacks */
 static int usbredirhost_start_stream_unlocked(struct usbredirhost *host,
     uint8_t ep)
@@ -1067,9 +1856,12 @@ static int usbredirhost_start_stream_unlocked(struct usbredirhost *host,
         if (ep & LIBUSB_ENDPOINT_IN) {
             host->endpoint[EP2I(ep)].transfer[i]->id =
                 i * host->endpoint[EP2I(ep)].pkts_per_transfer;
-        }
-        status = usbredirhost_submit_stream_transfer_unlocked(host,
+            status = usbredirhost_submit_in_stream_transfer_unlocked(host,
+                               host->endpoint[EP2I(ep)].transfer[i]);
+        } else {
+            status = usbredirhost_submit_stream_transfer_unlocked(host,
                                host->endpoint[EP2I(ep)].transfer[i]);
+        }
         if (status != usb_redir_success) {
             return status;
         }
@@ -1085,17 +1877,85 @@ static void usbredirhost_stop_stream(struct usbredirhost *host,
         return;
     }
 
-    usbredirhost_cancel_stream(host, ep);
+    LOCK(host);
+    usbredirhost_cancel_stream_unlocked(host, ep);
+    usbredirhost_purge_stream_data(host, ep);
+    UNLOCK(host);
     usbredirhost_send_stream_status(host, id, ep, usb_redir_success);
     FLUSH(host);
 }
 
+/* Returns the interval of a periodic endpoint in usec */
+static uint32_t usbredirhost_ep_period(struct usbredirhost *host, uint8_t ep)
+{
+    int interval = host->endpoint[EP2I(ep)].interval;
+
+    if (interval < 1)
+        interval = 1;
+
+    /* Full / low speed interrupt endpoints have an interval in frames,
+       everything else uses 2^(interval - 1) (micro)frames */
+    if (libusb_get_device_speed(host->dev) < LIBUSB_SPEED_HIGH &&
+            host->endpoint[EP2I(ep)].type == usb_redir_type_interrupt)
+        return 1000 * interval;
+
+    if (interval > 16)
+        interval = 16;
+    if (libusb_get_device_speed(host->dev) < LIBUSB_SPEED_HIGH)
+        return 1000 << (interval - 1);
+    return 125 << (interval - 1);
+}
+
+/* Set how long (in usec) input stream data may wait in our write queue
+   before we start dropping it, see usbredirhost_drop_stream_data */
+static void usbredirhost_set_max_latency(struct usbredirhost *host,
+    uint8_t ep, uint8_t pkts_per_transfer, uint8_t transfer_count)
+{
+    struct usbredirhost_ep *endp = &host->endpoint[EP2I(ep)];
+    /* 64 bits so that large periods do not overflow before clamping */
+    uint64_t max_latency = 0;
+
+    if (host->flags & usbredirhost_fl_drop_never) {
+        endp->max_latency = 0;
+        return;
+    }
+
+    if (host->flags & usbredirhost_fl_drop_throughput_first) {
+        endp->max_latency = (endp->type == usb_redir_type_bulk) ?
+                            0 : THROUGHPUT_LATENCY;
+        return;
+    }
+
+    switch (endp->type) {
+    case usb_redir_type_iso:
+        /* Twice the time covered by the transfers we keep in flight */
+        max_latency = 2 * (uint64_t)transfer_count * pkts_per_transfer *
+                      usbredirhost_ep_period(host, ep);
+        if (max_latency < ISO_LATENCY_MIN)
+            max_latency = ISO_LATENCY_MIN;
+        if (max_latency > ISO_LATENCY_MAX)
+            max_latency = ISO_LATENCY_MAX;
+        break;
+    case usb_redir_type_interrupt:
+        max_latency = 16 * (uint64_t)usbredirhost_ep_period(host, ep);
+        if (max_latency < INTERRUPT_LATENCY_MIN)
+            max_latency = INTERRUPT_LATENCY_MIN;
+        if (max_latency > INTERRUPT_LATENCY_MAX)
+            max_latency = INTERRUPT_LATENCY_MAX;
+        break;
+    case usb_redir_type_bulk:
+        max_latency = BULK_LATENCY;
+        break;
+    }
+    endp->max_latency = max_latency;
+}
+
 /* Called from both parser read and packet complete callbacks */
 static void usbredirhost_alloc_stream_unlocked(struct usbredirhost *host,
     uint64_t id, uint8_t ep, uint8_t type, uint8_t pkts_per_transfer,
     int pkt_size, uint8_t transfer_count, int send_success)
 {
-    int i, buf_size, status = usb_redir_success;
+    int i, buf_size, pkt_type, status = usb_redir_success;
     unsigned char *buffer;
 
     if (host->disconnected) {
@@ -1124,6 +1984,17 @@ static void usbredirhost_alloc_stream_unlocked(struct usbredirhost *host,
         return;
     }
 
+    switch (type) {
+    case usb_redir_type_iso:
+        pkt_type = usb_redir_iso_packet;
+        break;
+    case usb_redir_type_interrupt:
+        pkt_type = usb_redir_interrupt_packet;
+        break;
+    default:
+        pkt_type = usb_redir_buffered_bulk_packet;
+    }
+
     DEBUG("allocating stream ep %02X type %d packet-size %d pkts %d urbs %d",
           ep, type, pkt_size, pkts_per_transfer, transfer_count);
     for (i = 0; i < transfer_count; i++) {
@@ -1135,7 +2006,16 @@ static void usbredirhost_alloc_stream_unlocked(struct usbredirhost *host,
         }
 
         buf_size = pkt_size * pkts_per_transfer;
-        buffer = malloc(buf_size);
+        if (type == usb_redir_type_iso) {
+            buffer = usbredirparser_alloc_packet_data(host->parser, pkt_type,
+                                                      buf_size);
+        } else {
+            /* Received data gets send without copying, see
+               usbredirhost_send_stream_transfer_data */
+            buffer = usbredirparser_alloc_packet_buffer(host->parser,
+                                                        pkt_type, buf_size);
+            host->endpoint[EP2I(ep)].transfer[i]->packet_buf = 1;
+        }
         if (!buffer) {
             goto alloc_error;
         }
@@ -1167,6 +2047,7 @@ static void usbredirhost_alloc_stream_unlocked(struct usbredirhost *host,
     host->endpoint[EP2I(ep)].drop_packets = 0;
     host->endpoint[EP2I(ep)].pkts_per_transfer = pkts_per_transfer;
     host->endpoint[EP2I(ep)].transfer_count = transfer_count;
+    usbredirhost_set_max_latency(host, ep, pkts_per_transfer, transfer_count);
 
     /* For input endpoints submit the transfers now */
     if (ep & LIBUSB_ENDPOINT_IN) {
@@ -1205,41 +2086,72 @@ static void usbredirhost_clear_stream_stall_unlocked(
     int r;
     uint8_t pkts_per_transfer = host->endpoint[EP2I(ep)].pkts_per_transfer;
     uint8_t transfer_count    = host->endpoint[EP2I(ep)].transfer_count;
-    int pkt_size = host->endpoint[EP2I(ep)].transfer[0]->transfer->length /
-                   pkts_per_transfer;
+    uint8_t flow_control      = host->endpoint[EP2I(ep)].flow_control;
+    int64_t credits           = host->endpoint[EP2I(ep)].credits;
+    int i, pkt_size = host->endpoint[EP2I(ep)].transfer[0]->transfer->length /
+                      pkts_per_transfer;
 
     WARNING("buffered stream on endpoint %02X stalled, clearing stall", ep);
 
+    /* The restarted stream keeps the credits, including those reserved by
+       the transfers getting cancelled */
+    for (i = 0; flow_control && i < transfer_count; i++) {
+        if (host->endpoint[EP2I(ep)].transfer[i]->packet_idx != PAUSED_IDX)
+            credits += usbredirhost_transfer_credits(host, ep);
+    }
+
     usbredirhost_cancel_stream_unlocked(host, ep);
     r = libusb_clear_halt(host->handle, ep);
     if (r < 0) {
         usbredirhost_send_stream_status(host, id, ep, usb_redir_stall);
         return;
     }
+    host->endpoint[EP2I(ep)].flow_control = flow_control;
+    host->endpoint[EP2I(ep)].credits = credits;
     usbredirhost_alloc_stream_unlocked(host, id, ep,
                                        host->endpoint[EP2I(ep)].type,
                                        pkts_per_transfer, pkt_size,
                                        transfer_count, 0);
+    if (!host->endpoint[EP2I(ep)].transfer_count) {
+        host->endpoint[EP2I(ep)].flow_control = 0;
+        host->endpoint[EP2I(ep)].credits = 0;
+    }
 }
 
 /**************************************************************************/
 
-/* Called from close and parser read callbacks */
-static int usbredirhost_cancel_pending_urbs(struct usbredirhost *host)
+/* Note caller must hold the host lock */
+static int usbredirhost_cancel_ep_transfers_unlocked(
+    struct usbredirhost *host, uint8_t ep)
 {
     struct usbredirtransfer *t;
-    int i, wait;
+    int wait = 0;
 
-    LOCK(host);
+    for (t = host->endpoint[EP2I(ep)].transfers_head; t; t = t->ep_next) {
+        libusb_cancel_transfer(t->transfer);
+        wait = 1;
+    }
+
+    return wait;
+}
+
+/* Called from close and parser read callbacks, takes and releases the host
+   lock once per endpoint */
+static int usbredirhost_cancel_pending_urbs(struct usbredirhost *host)
+{
+    int i, wait = 0;
+
+    /* Take the lock per endpoint, so that packet completion callbacks for
+       other endpoints do not have to wait for us cancelling everything */
     for (i = 0; i < MAX_ENDPOINTS; i++) {
+        LOCK(host);
         usbredirhost_cancel_stream_unlocked(host, I2EP(i));
+        wait |= usbredirhost_cancel_ep_transfers_unlocked(host, I2EP(i));
+        UNLOCK(host);
     }
 
-    wait = host->cancels_pending;
-    for (t = host->transfers_head.next; t; t = t->next) {
-        libusb_cancel_transfer(t->transfer);
-        wait = 1;
-    }
+    LOCK(host);
+    wait |= host->cancels_pending;
     UNLOCK(host);
 
     return wait;
@@ -1249,7 +2161,6 @@ static int usbredirhost_cancel_pending_urbs(struct usbredirhost *host)
 static void usbredirhost_cancel_pending_urbs_on_interface(
     struct usbredirhost *host, int i)
 {
-    struct usbredirtransfer *t;
     const struct libusb_interface_descriptor *intf_desc;
 
     LOCK(host);
@@ -1259,11 +2170,8 @@ static void usbredirhost_cancel_pending_urbs_on_interface(
         uint8_t ep = intf_desc->endpoint[i].bEndpointAddress;
 
         usbredirhost_cancel_stream_unlocked(host, ep);
-
-        for (t = host->transfers_head.next; t; t = t->next) {
-            if (t->transfer->endpoint == ep)
-                libusb_cancel_transfer(t->transfer);
-        }
+        usbredirhost_purge_stream_data(host, ep);
+        usbredirhost_cancel_ep_transfers_unlocked(host, ep);
     }
 
     UNLOCK(host);
@@ -1337,6 +2245,72 @@ static int usbredirhost_handle_iso_status(struct usbredirhost *host,
     }
 }
 
+/* Send all packets of a completed iso input transfer to the usb-guest as a
+   single usb_redir_multi_iso_packet, return value:
+    0 Packets sent (or dropped), continue with resubmitting the transfer
+    1 Not possible, the packets need to be send one by one
+    2 Stream borked, see usbredirhost_handle_iso_status
+   Note caller must hold the host lock */
+static int usbredirhost_send_multi_iso_packet(struct usbredirhost *host,
+    struct usbredirtransfer *transfer)
+{
+    struct libusb_transfer *libusb_transfer = transfer->transfer;
+    uint8_t ep = libusb_transfer->endpoint;
+    int i, r, len, count = libusb_transfer->num_iso_packets;
+    struct usb_redir_multi_iso_packet_header multi_iso_packet = {
+        .endpoint     = ep,
+        .packet_count = count,
+    };
+    struct usb_redir_multi_iso_packet_desc *desc;
+    uint8_t *buf, *data;
+
+    if (!usbredirparser_peer_has_cap(host->parser,
+                                     usb_redir_cap_multi_iso_packets))
+        return 1;
+
+    buf = usbredirparser_alloc_packet_buffer(host->parser,
+                                             usb_redir_multi_iso_packet,
+                          count * sizeof(*desc) + libusb_transfer->length);
+    if (!buf)
+        return 1;
+
+    desc = (struct usb_redir_multi_iso_packet_desc *)buf;
+    data = buf + count * sizeof(*desc);
+    for (i = 0; i < count; i++) {
+        r   = libusb_transfer->iso_packet_desc[i].status;
+        len = libusb_transfer->iso_packet_desc[i].actual_length;
+        switch (usbredirhost_handle_iso_status(host, transfer->id + i,
+                                               ep, r)) {
+        case 0:
+            break;
+        case 1:
+            len = 0;
+            break;
+        case 2:
+            usbredirparser_free_packet_buffer(host->parser, buf);
+            return 2;
+        }
+        desc[i].status = libusb_status_or_error_to_redir_status(host, r);
+        desc[i].length = len;
+        memcpy(data, libusb_get_iso_packet_buffer(libusb_transfer, i), len);
+        data += len;
+    }
+
+    multi_iso_packet.length = data - buf;
+    if (usbredirhost_drop_stream_data(host, ep, usb_redir_success,
+                                      multi_iso_packet.length)) {
+        usbredirparser_free_packet_buffer(host->parser, buf);
+        return 0;
+    }
+
+    DEBUG("iso-in complete ep %02X packets %d len %u id %"PRIu64,
+          ep, count, multi_iso_packet.length, transfer->id);
+    usbredirparser_send_multi_iso_packet_buf(host->parser, transfer->id,
+                                             &multi_iso_packet, buf,
+                                             multi_iso_packet.length);
+    return 0;
+}
+
 static void LIBUSB_CALL usbredirhost_iso_packet_complete(
     struct libusb_transfer *libusb_transfer)
 {
@@ -1381,6 +2355,17 @@ static void LIBUSB_CALL usbredirhost_iso_packet_complete(
         goto unlock;
     }
 
+    /* Send all input packets to the usb-guest in one go if possible */
+    if (ep & LIBUSB_ENDPOINT_IN) {
+        switch (usbredirhost_send_multi_iso_packet(host, transfer)) {
+        case 0:
+            transfer->id += libusb_transfer->num_iso_packets;
+            goto resubmit;
+        case 2:
+            goto unlock;
+        }
+    }
+
     /* Check per packet status and send ok input packets to usb-guest */
     for (i = 0; i < libusb_transfer->num_iso_packets; i++) {
         r   = libusb_transfer->iso_packet_desc[i].status;
@@ -1417,7 +2402,7 @@ static void LIBUSB_CALL usbredirhost_iso_packet_complete(
 resubmit:
         transfer->id += (host->endpoint[EP2I(ep)].transfer_count - 1) *
                         libusb_transfer->num_iso_packets;
-        usbredirhost_submit_stream_transfer_unlocked(host, transfer);
+        usbredirhost_submit_in_stream_transfer_unlocked(host, transfer);
     } else {
         for (i = 0; i < host->endpoint[EP2I(ep)].transfer_count; i++) {
             transfer = host->endpoint[EP2I(ep)].transfer[i];
@@ -1475,14 +2460,14 @@ static void LIBUSB_CALL usbredirhost_buffered_packet_complete(
         len = 0;
     }
 
-    usbredirhost_send_stream_data(host, transfer->id, ep,
-                           libusb_status_or_error_to_redir_status(host, r),
-                           transfer->transfer->buffer, len);
     usbredirhost_log_data(host, "buffered data in:",
                           transfer->transfer->buffer, len);
+    usbredirhost_send_stream_transfer_data(host, transfer,
+                           libusb_status_or_error_to_redir_status(host, r),
+                           len);
 
     transfer->id += host->endpoint[EP2I(ep)].transfer_count;
-    usbredirhost_submit_stream_transfer_unlocked(host, transfer);
+    usbredirhost_submit_in_stream_transfer_unlocked(host, transfer);
 unlock:
     UNLOCK(host);
     FLUSH(host);
@@ -1772,6 +2757,28 @@ static void usbredirhost_stop_bulk_receiving(void *priv, uint64_t id,
     usbredirhost_stop_stream(priv, id, stop_bulk_receiving->endpoint);
 }
 
+static void usbredirhost_ep_credits(void *priv, uint64_t id,
+    struct usb_redir_ep_credits_header *ep_credits)
+{
+    struct usbredirhost *host = priv;
+    uint8_t ep = ep_credits->endpoint;
+
+    if (host->disconnected) {
+        return;
+    }
+
+    DEBUG("ep %02X credits %u", ep, ep_credits->credits);
+
+    /* Credits can be granted before starting the stream, the stream then
+       starts with flow control, they are dropped when it stops */
+    LOCK(host);
+    host->endpoint[EP2I(ep)].flow_control = 1;
+    host->endpoint[EP2I(ep)].credits += ep_credits->credits;
+    usbredirhost_resume_stream_unlocked(host, ep);
+    UNLOCK(host);
+    FLUSH(host);
+}
+
 /**************************************************************************/
 
 static void usbredirhost_cancel_data_packet(void *priv, uint64_t id)
@@ -1800,17 +2807,32 @@ static void usbredirhost_cancel_data_packet(void *priv, uint64_t id)
      */
 
     LOCK(host);
-    for (t = host->transfers_head.next; t; t = t->next) {
-        if (t->id == id) {
-            break;
-        }
-    }
+    t = usbredirhost_find_transfer(host, id);
 
     /*
      * Note not finding the transfer is not an error, the transfer may have
      * completed by the time we receive the cancel.
      */
-    if (t) {
+    if (t && t->chunked) {
+        /* Cancel all transfers of the chunked packet, and send a single
+           cancelled status for the packet */
+        struct usbredirhost_chunked *chunked = t->chunked;
+
+        chunked->cancelled = 1;
+        for (t = host->endpoint[EP2I(chunked->bulk_packet.endpoint)].
+                     transfers_head; t; t = t->ep_next) {
+            if (t->chunked == chunked) {
+                t->cancelled = 1;
+                libusb_cancel_transfer(t->transfer);
+            }
+        }
+        bulk_packet = chunked->bulk_packet;
+        bulk_packet.status = usb_redir_cancelled;
+        bulk_packet.length = 0;
+        bulk_packet.length_high = 0;
+        usbredirparser_send_bulk_packet(host->parser, id,
+                                        &bulk_packet, NULL, 0);
+    } else if (t) {
         t->cancelled = 1;
         libusb_cancel_transfer(t->transfer);
         switch(t->transfer->type) {
@@ -1902,7 +2924,6 @@ static void usbredirhost_control_packet(void *priv, uint64_t id,
     if (host->disconnected) {
         usbredirhost_send_control_status(host, id, control_packet,
                                          usb_redir_ioerror);
-        usbredirparser_free_packet_data(host->parser, data);
         FLUSH(host);
         return;
     }
@@ -1912,7 +2933,6 @@ static void usbredirhost_control_packet(void *priv, uint64_t id,
         ERROR("error control packet on non control ep %02X", ep);
         usbredirhost_send_control_status(host, id, control_packet,
                                          usb_redir_inval);
-        usbredirparser_free_packet_data(host->parser, data);
         FLUSH(host);
         return;
     }
@@ -1933,17 +2953,17 @@ static void usbredirhost_control_packet(void *priv, uint64_t id,
         return;
     }
 
-    buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + control_packet->length);
+    buffer = usbredirparser_alloc_packet_data(host->parser,
+                 usb_redir_control_packet,
+                 LIBUSB_CONTROL_SETUP_SIZE + control_packet->length);
     if (!buffer) {
         ERROR("out of memory allocating transfer buffer, dropping packet");
-        usbredirparser_free_packet_data(host->parser, data);
         return;
     }
 
-    transfer = usbredirhost_alloc_transfer(host, 0);
+    transfer = usbredirhost_get_transfer(host);
     if (!transfer) {
-        free(buffer);
-        usbredirparser_free_packet_data(host->parser, data);
+        usbredirparser_free_packet_data(host->parser, buffer);
         return;
     }
 
@@ -1956,8 +2976,9 @@ static void usbredirhost_control_packet(void *priv, uint64_t id,
 
     if (!(ep & LIBUSB_ENDPOINT_IN)) {
         usbredirhost_log_data(host, "ctrl data out:", data, data_len);
+        /* Note data is only lent to us (usbredirparser_fl_borrow_packet_data)
+           so there is no need to free it */
         memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, data_len);
-        usbredirparser_free_packet_data(host->parser, data);
     }
 
     libusb_fill_control_transfer(transfer->transfer, host->handle, buffer,
@@ -1978,6 +2999,33 @@ static void usbredirhost_control_packet(void *priv, uint64_t id,
     }
 }
 
+/* Drop a reference to a chunked bulk packet, sending its status once the
+   last one is gone. Note caller must hold the host lock */
+static void usbredirhost_put_chunked(struct usbredirhost *host,
+    struct usbredirhost_chunked *chunked)
+{
+    if (--chunked->refcount)
+        return;
+
+    if (!chunked->cancelled) {
+        chunked->bulk_packet.status = chunked->status;
+        chunked->bulk_packet.length = chunked->actual_length;
+        chunked->bulk_packet.length_high = chunked->actual_length >> 16;
+        usbredirparser_send_bulk_packet(host->parser, chunked->id,
+                                        &chunked->bulk_packet, NULL, 0);
+    }
+    free(chunked);
+}
+
+/* Note caller must hold the host lock */
+static void usbredirhost_set_chunked_status(
+    struct usbredirhost_chunked *chunked, uint8_t status)
+{
+    /* Report the first error */
+    if (chunked->status == usb_redir_success)
+        chunked->status = status;
+}
+
 static void LIBUSB_CALL usbredirhost_bulk_packet_complete(
     struct libusb_transfer *libusb_transfer)
 {
@@ -1996,15 +3044,23 @@ static void LIBUSB_CALL usbredirhost_bulk_packet_complete(
 
     LOCK(host);
 
-    if (!transfer->cancelled) {
+    if (transfer->chunked) {
+        host->chunks_in_flight--;
+        usbredirhost_set_chunked_status(transfer->chunked, bulk_packet.status);
+        transfer->chunked->actual_length += libusb_transfer->actual_length;
+        usbredirhost_put_chunked(host, transfer->chunked);
+    } else if (!transfer->cancelled) {
         if (bulk_packet.endpoint & LIBUSB_ENDPOINT_IN) {
             usbredirhost_log_data(host, "bulk data in:",
                                   libusb_transfer->buffer,
                                   libusb_transfer->actual_length);
-            usbredirparser_send_bulk_packet(host->parser, transfer->id,
-                                            &bulk_packet,
-                                            libusb_transfer->buffer,
-                                            libusb_transfer->actual_length);
+            /* The buffer was allocated with usbredirparser_alloc_packet_buffer
+               so we can hand it to the parser without copying */
+            usbredirparser_send_bulk_packet_buf(host->parser, transfer->id,
+                                                &bulk_packet,
+                                                libusb_transfer->buffer,
+                                                libusb_transfer->actual_length);
+            libusb_transfer->buffer = NULL;
         } else {
             usbredirparser_send_bulk_packet(host->parser, transfer->id,
                                             &bulk_packet, NULL, 0);
@@ -2041,7 +3097,6 @@ static void usbredirhost_bulk_packet(void *priv, uint64_t id,
     if (host->disconnected) {
         usbredirhost_send_bulk_status(host, id, bulk_packet,
                                       usb_redir_ioerror);
-        usbredirparser_free_packet_data(host->parser, data);
         FLUSH(host);
         return;
     }
@@ -2049,26 +3104,35 @@ static void usbredirhost_bulk_packet(void *priv, uint64_t id,
     if (host->endpoint[EP2I(ep)].type != usb_redir_type_bulk) {
         ERROR("error bulk packet on non bulk ep %02X", ep);
         usbredirhost_send_bulk_status(host, id, bulk_packet, usb_redir_inval);
-        usbredirparser_free_packet_data(host->parser, data);
         FLUSH(host);
         return;
     }
 
     if (ep & LIBUSB_ENDPOINT_IN) {
-        data = malloc(len);
+        data = usbredirparser_alloc_packet_buffer(host->parser,
+                                                  usb_redir_bulk_packet, len);
         if (!data) {
             ERROR("out of memory allocating bulk buffer, dropping packet");
             return;
         }
     } else {
         usbredirhost_log_data(host, "bulk data out:", data, data_len);
-        /* Note no memcpy, we can re-use the data buffer the parser
-           malloc-ed for us and expects us to free */
+        /* Note this does not copy data the parser has read into a buffer
+           of its own (the common case for large packets), it hands over
+           that buffer instead */
+        data = usbredirparser_take_packet_data(host->parser, data, data_len);
+        if (!data && data_len) {
+            ERROR("out of memory allocating bulk buffer, dropping packet");
+            return;
+        }
     }
 
-    transfer = usbredirhost_alloc_transfer(host, 0);
+    transfer = usbredirhost_get_transfer(host);
     if (!transfer) {
-        free(data);
+        if (ep & LIBUSB_ENDPOINT_IN)
+            usbredirparser_free_packet_buffer(host->parser, data);
+        else
+            usbredirparser_free_packet_data(host->parser, data);
         return;
     }
 
@@ -2078,6 +3142,7 @@ static void usbredirhost_bulk_packet(void *priv, uint64_t id,
                               usbredirhost_bulk_packet_complete,
                               transfer, BULK_TIMEOUT);
     transfer->id = id;
+    transfer->packet_buf = (ep & LIBUSB_ENDPOINT_IN) ? 1 : 0;
     transfer->bulk_packet = *bulk_packet;
 
     usbredirhost_add_transfer(host, transfer);
@@ -2092,6 +3157,171 @@ static void usbredirhost_bulk_packet(void *priv, uint64_t id,
     }
 }
 
+/* Large bulk out packets get passed to us in chunks by the parser, each chunk
+   gets submitted as a separate transfer as soon as it has been received.
+   The guest gets a single status for the packet once all of them have
+   completed. At most MAX_CHUNKS_IN_FLIGHT chunk transfers are in flight,
+   see usbredirhost_wait_for_chunks. */
+static void usbredirhost_bulk_packet_chunk(void *priv, uint64_t id,
+    struct usb_redir_bulk_packet_header *bulk_packet,
+    uint8_t *data, int data_len, int offset, int last)
+{
+    struct usbredirhost *host = priv;
+    uint8_t ep = bulk_packet->endpoint;
+    struct usbredirhost_chunked *chunked;
+    struct usbredirtransfer *transfer;
+    int r, submit = 0;
+
+    DEBUG("bulk chunk submit ep %02X offset %d len %d", ep, offset, data_len);
+
+    if (offset == 0) {
+        chunked = calloc(1, sizeof(*chunked));
+        if (!chunked) {
+            ERROR("out of memory, dropping chunked bulk packet");
+            return;
+        }
+        chunked->id = id;
+        chunked->bulk_packet = *bulk_packet;
+        chunked->refcount = 1;
+        chunked->status = usb_redir_success;
+        if (host->disconnected) {
+            chunked->status = usb_redir_ioerror;
+        } else if (host->endpoint[EP2I(ep)].type != usb_redir_type_bulk) {
+            ERROR("error bulk packet on non bulk ep %02X", ep);
+            chunked->status = usb_redir_inval;
+        }
+        LOCK(host);
+        host->chunked_cur = chunked;
+        UNLOCK(host);
+    }
+
+    LOCK(host);
+    chunked = host->chunked_cur;
+    if (chunked) {
+        /* data is NULL if the parser had to drop the rest of the packet */
+        if (!data)
+            usbredirhost_set_chunked_status(chunked, usb_redir_ioerror);
+        if (chunked->status == usb_redir_success && !chunked->cancelled) {
+            chunked->refcount++;
+            submit = 1;
+        }
+        if (last)
+            host->chunked_cur = NULL;
+    }
+    UNLOCK(host);
+
+    if (submit) {
+        usbredirhost_log_data(host, "bulk data out:", data, data_len);
+        data = usbredirparser_take_packet_data(host->parser, data, data_len);
+        transfer = data ? usbredirhost_get_transfer(host) : NULL;
+        if (!transfer) {
+            ERROR("out of memory allocating bulk buffer, dropping packet");
+            usbredirparser_free_packet_data(host->parser, data);
+            LOCK(host);
+            usbredirhost_set_chunked_status(chunked, usb_redir_ioerror);
+            usbredirhost_put_chunked(host, chunked);
+            UNLOCK(host);
+        } else {
+            host->reset = 0;
+
+            libusb_fill_bulk_transfer(transfer->transfer, host->handle, ep,
+                                      data, data_len,
+                                      usbredirhost_bulk_packet_complete,
+                                      transfer, BULK_TIMEOUT);
+            transfer->id = id;
+            transfer->chunked = chunked;
+            transfer->bulk_packet = *bulk_packet;
+
+            LOCK(host);
+            host->chunks_in_flight++;
+            UNLOCK(host);
+            usbredirhost_add_transfer(host, transfer);
+
+            r = libusb_submit_transfer(transfer->transfer);
+            if (r < 0) {
+                ERROR("error submitting bulk transfer on ep %02X: %s",
+                      ep, libusb_error_name(r));
+                transfer->transfer->actual_length = 0;
+                transfer->transfer->status = r;
+                usbredirhost_bulk_packet_complete(transfer->transfer);
+            }
+        }
+    }
+
+    if (chunked && last) {
+        LOCK(host);
+        usbredirhost_put_chunked(host, chunked);
+        UNLOCK(host);
+    }
+    FLUSH(host);
+}
+
+/* Let the parser store the data of iso out packets directly in the next free
+   packet slot of the iso out stream, rather then copying it there from a
+   separately allocated buffer in usbredirhost_iso_packet */
+static uint8_t *usbredirhost_place_packet_data(void *priv, uint64_t id,
+    int type, void *type_header, int data_len)
+{
+    struct usbredirhost *host = priv;
+    struct usb_redir_iso_packet_header *iso_packet = type_header;
+    uint8_t ep = iso_packet->endpoint;
+    struct usbredirtransfer *transfer;
+    uint8_t *data = NULL;
+
+    if (type != usb_redir_iso_packet || (ep & LIBUSB_ENDPOINT_IN))
+        return NULL;
+
+    LOCK(host);
+
+    /* Release the previous placement if its packet was invalid */
+    usbredirhost_put_iso_out_placed_unlocked(host, NULL);
+
+    /* Only place packets which usbredirhost_iso_packet will queue */
+    if (host->disconnected ||
+            host->endpoint[EP2I(ep)].type != usb_redir_type_iso ||
+            host->endpoint[EP2I(ep)].transfer_count == 0 ||
+            data_len > host->endpoint[EP2I(ep)].max_packetsize ||
+            host->endpoint[EP2I(ep)].drop_packets)
+        goto leave;
+
+    transfer = host->endpoint[EP2I(ep)].transfer[
+                                          host->endpoint[EP2I(ep)].out_idx];
+    if (transfer->packet_idx == SUBMITTED_IDX)
+        goto leave;
+
+    data = libusb_get_iso_packet_buffer(transfer->transfer,
+                                        transfer->packet_idx);
+    host->iso_out_placed = transfer;
+    host->iso_out_placed_data = data;
+
+leave:
+    UNLOCK(host);
+    return data;
+}
+
+/* Note caller must hold the host lock. Ends the current placement (if any),
+   returns 1 if data is the data placed by usbredirhost_place_packet_data,
+   -1 if it is but its stream has been stopped since, and 0 otherwise */
+static int usbredirhost_put_iso_out_placed_unlocked(struct usbredirhost *host,
+    uint8_t *data)
+{
+    struct usbredirtransfer *transfer = host->iso_out_placed;
+    int placed;
+
+    if (!transfer)
+        return 0;
+
+    placed = (data == host->iso_out_placed_data) ? 1 : 0;
+    if (transfer->cancelled) {
+        usbredirhost_free_transfer(transfer);
+        if (placed)
+            placed = -1;
+    }
+    host->iso_out_placed = NULL;
+    host->iso_out_placed_data = NULL;
+    return placed;
+}
+
 static void usbredirhost_iso_packet(void *priv, uint64_t id,
     struct usb_redir_iso_packet_header *iso_packet,
     uint8_t *data, int data_len)
@@ -2099,10 +3329,14 @@ static void usbredirhost_iso_packet(void *priv, uint64_t id,
     struct usbredirhost *host = priv;
     uint8_t ep = iso_packet->endpoint;
     struct usbredirtransfer *transfer;
-    int i, j, status = usb_redir_success;
+    int i, j, placed, status = usb_redir_success;
 
     LOCK(host);
 
+    placed = usbredirhost_put_iso_out_placed_unlocked(host, data);
+    if (placed == -1)
+        goto leave;
+
     if (host->disconnected) {
         status = usb_redir_ioerror;
         goto leave;
@@ -2148,8 +3382,9 @@ static void usbredirhost_iso_packet(void *priv, uint64_t id,
     if (j == 0) {
         transfer->id = id;
     }
-    memcpy(libusb_get_iso_packet_buffer(transfer->transfer, j),
-           data, data_len);
+    if (!placed)
+        memcpy(libusb_get_iso_packet_buffer(transfer->transfer, j),
+               data, data_len);
     transfer->transfer->iso_packet_desc[j].length = data_len;
     DEBUG("iso-in queue ep %02X urb %d pkt %d len %d id %"PRIu64,
            ep, i, j, data_len, transfer->id);
@@ -2181,7 +3416,6 @@ static void usbredirhost_iso_packet(void *priv, uint64_t id,
 
 leave:
     UNLOCK(host);
-    usbredirparser_free_packet_data(host->parser, data);
     if (status != usb_redir_success) {
         usbredirhost_send_stream_status(host, id, ep, status);
     }
@@ -2238,7 +3472,6 @@ static void usbredirhost_interrupt_packet(void *priv, uint64_t id,
     if (host->disconnected) {
         usbredirhost_send_interrupt_status(host, id, interrupt_packet,
                                            usb_redir_ioerror);
-        usbredirparser_free_packet_data(host->parser, data);
         FLUSH(host);
         return;
     }
@@ -2247,7 +3480,6 @@ static void usbredirhost_interrupt_packet(void *priv, uint64_t id,
         ERROR("error received interrupt packet for non interrupt ep %02X", ep);
         usbredirhost_send_interrupt_status(host, id, interrupt_packet,
                                            usb_redir_inval);
-        usbredirparser_free_packet_data(host->parser, data);
         FLUSH(host);
         return;
     }
@@ -2256,17 +3488,19 @@ static void usbredirhost_interrupt_packet(void *priv, uint64_t id,
         ERROR("error received interrupt out packet is larger than wMaxPacketSize");
         usbredirhost_send_interrupt_status(host, id, interrupt_packet,
                                            usb_redir_inval);
-        usbredirparser_free_packet_data(host->parser, data);
         FLUSH(host);
         return;
     }
 
     usbredirhost_log_data(host, "interrupt data out:", data, data_len);
 
-    /* Note no memcpy, we can re-use the data buffer the parser
-       malloc-ed for us and expects us to free */
+    data = usbredirparser_take_packet_data(host->parser, data, data_len);
+    if (!data && data_len) {
+        ERROR("out of memory allocating interrupt buffer, dropping packet");
+        return;
+    }
 
-    transfer = usbredirhost_alloc_transfer(host, 0);
+    transfer = usbredirhost_get_transfer(host);
     if (!transfer) {
         usbredirparser_free_packet_data(host->parser, data);
         return;
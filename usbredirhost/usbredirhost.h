@@ -57,10 +57,30 @@ typedef void (*usbredirhost_flush_writes)(void *priv);
       libusb_context from the passed in libusb_device_handle) when there are
       events waiting on the filedescriptors libusb_get_pollfds returns
    3) usbredirhost is partially multi-thread safe, see README.multi-thread
+
+   When the connection to the usb-guest does not keep up with the data
+   received from input streams, the usbredirhost drops stream data, how
+   eager it is to do so is selected through the flags:
+   -By default the usbredirhost bounds the latency per endpoint, the bound
+    being derived from the endpoint type, interval and the stream parameters
+   -usbredirhost_fl_drop_throughput_first never drops buffered bulk data,
+    and only drops iso and interrupt data once it is 1 second late
+   -usbredirhost_fl_drop_never never drops stream data
+   Streams for which the usb-guest does credit based flow control never
+   drop data.
+
+   With the usbredirhost_fl_compression flag the usbredirhost offers the
+   usb-guest usb_redir_cap_compression, so that bulk data gets zlib
+   compressed when both sides support it. This costs cpu time, and is only
+   worthwhile on slow links, so it is off by default.
 */
 
 enum {
     usbredirhost_fl_write_cb_owns_buffer = 0x01, /* See usbredirparser.h */
+    usbredirhost_fl_drop_throughput_first = 0x02,
+    usbredirhost_fl_drop_never = 0x04,
+    usbredirhost_fl_buffer_pool = 0x08, /* See usbredirparser.h */
+    usbredirhost_fl_compression = 0x10,
 };
 
 struct usbredirhost *usbredirhost_open(
@@ -85,6 +105,25 @@ struct usbredirhost *usbredirhost_open_full(
     usbredirparser_free_lock free_lock_func,
     void *func_priv, const char *version, int verbose, int flags);
 
+/* Like usbredirhost_open_full, the alloc_mem, realloc_mem and free_mem funcs
+   (which may be NULL) are used for all packet data and transfer buffers,
+   see usbredirparser_alloc_mem in usbredirparser.h */
+struct usbredirhost *usbredirhost_open_full_alloc(
+    libusb_context *usb_ctx,
+    libusb_device_handle *usb_dev_handle,
+    usbredirparser_log log_func,
+    usbredirparser_read  read_guest_data_func,
+    usbredirparser_write write_guest_data_func,
+    usbredirhost_flush_writes flush_writes_func,
+    usbredirparser_alloc_lock alloc_lock_func,
+    usbredirparser_lock lock_func,
+    usbredirparser_unlock unlock_func,
+    usbredirparser_free_lock free_lock_func,
+    usbredirparser_alloc_mem alloc_mem_func,
+    usbredirparser_realloc_mem realloc_mem_func,
+    usbredirparser_free_mem free_mem_func,
+    void *func_priv, const char *version, int verbose, int flags);
+
 /* Closes (destroys) the usbredirhost, if the usbredirhost currently
    is redirecting a device this function will first call
    usbredirhost_set_device(host, NULL); See the notes for that function!
@@ -124,6 +163,9 @@ int usbredirhost_set_device(struct usbredirhost *host,
    An usbredirhost_read_device_lost error means that the host has done the
    equivalent of usbredirhost_set_device(host, NULL) itself because the
    connection to the device was lost.
+   While too many transfers of a large bulk out packet are still in flight,
+   this function waits for some of them to complete before reading more data,
+   calling libusb_handle_events_timeout itself meanwhile.
    *) As determined by the faulty's package headers length field */
 enum {
     usbredirhost_read_io_error        = -1,
@@ -145,11 +187,53 @@ enum {
 };
 int usbredirhost_write_guest_data(struct usbredirhost *host);
 
+/* Calls to the flush_writes_func passed to usbredirhost_open_full get
+   deferred between usbredirhost_begin_batch and usbredirhost_end_batch, with
+   a single call made when the outermost batch ends, if any were deferred.
+   Batches may be nested. usbredirhost_read_guest_data uses a batch itself
+   around the handling of each chunk of data read (but not around the
+   read_guest_data_func calls), wrapping each libusb_handle_events call in a
+   batch does the same for transfer completions.
+   Note batches are per usbredirhost, not per thread, while one thread has a
+   batch open, flushes from other threads get deferred too. So do not keep a
+   batch open while blocking in libusb_handle_events for a long time. */
+void usbredirhost_begin_batch(struct usbredirhost *host);
+void usbredirhost_end_batch(struct usbredirhost *host);
+
 /* When passing the usbredirhost_fl_write_cb_owns_buffer flag to
    usbredirhost_open, this function must be called to free the data buffer
    passed to write_guest_data_func when done with this buffer. */
 void usbredirhost_free_write_buffer(struct usbredirhost *host, uint8_t *data);
 
+/* Set an optional vectored write function, which will be used instead of
+   write_guest_data_func to write multiple queued packets at once, see
+   usbredirparser_writev in usbredirparser.h. This should be called
+   directly after usbredirhost_open(_full), passing NULL unsets it. */
+void usbredirhost_set_writev_func(struct usbredirhost *host,
+    usbredirparser_writev writev_guest_data_func);
+
+/* Set a time to live (in microseconds) for iso (ep_type usb_redir_type_iso)
+   or interrupt (usb_redir_type_interrupt) input data queued for writing to
+   the usb-guest. Data which has waited for longer than this when its turn
+   to be written comes is dropped instead, see usbredirparser_set_packet_ttl.
+   This bounds the latency at the time of writing, combine it with the
+   usbredirhost_fl_drop_never flag to only drop data this way. */
+void usbredirhost_set_packet_ttl(struct usbredirhost *host, int ep_type,
+    uint32_t ttl);
+
+/* This returns the number of iso / interrupt packets dropped because their
+   time to live expired */
+uint64_t usbredirhost_get_expired_packets(struct usbredirhost *host,
+    int ep_type);
+
+/* Set the share of the connection to the usb-guest which the data of
+   endpoints of type ep_type gets when multiple endpoints have data queued
+   for writing, see usbredirparser_set_write_weight. weight must be between
+   1 and 256, the defaults are 4 for iso and interrupt endpoints and 1 for
+   bulk endpoints. Control and status packets are always written first. */
+void usbredirhost_set_write_weight(struct usbredirhost *host, int ep_type,
+    int weight);
+
 /* Get the *usbredir-guest's* filter, if any. If there is no filter,
    rules is set to NULL and rules_count to 0. */
 void usbredirhost_get_guest_filter(struct usbredirhost *host,
@@ -0,0 +1,554 @@
+/* usbredirmux.c usb redirection connection multiplexer
+
+   Copyright 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include "usbredirmux.h"
+
+/* A frame is a 32 bit channel id and a 32 bit payload length, followed by
+   the payload, all little endian */
+#define FRAME_HEADER_LEN 8
+/* Max payload of received frames */
+#define FRAME_MAX_LEN 65536
+/* Max payload of sent frames, this is how much a channel gets to send
+   before it is the next channels turn */
+#define FRAME_QUANTUM 16384
+/* Channel writes block when this much data is queued on the channel */
+#define CHANNEL_WRITE_BUF_MAX (256 * 1024)
+/* Reading from the transport stops when the next frame is for a channel
+   with this much received data not yet read by the channel */
+#define CHANNEL_READ_BUF_MAX (256 * 1024)
+
+/* Locking convenience macros */
+#define LOCK(mux) \
+    do { \
+        if ((mux)->lock) \
+            (mux)->lock_func((mux)->lock); \
+    } while (0)
+
+#define UNLOCK(mux) \
+    do { \
+        if ((mux)->lock) \
+            (mux)->unlock_func((mux)->lock); \
+    } while (0)
+
+#define WRITE_LOCK(mux) \
+    do { \
+        if ((mux)->write_lock) \
+            (mux)->lock_func((mux)->write_lock); \
+    } while (0)
+
+#define WRITE_UNLOCK(mux) \
+    do { \
+        if ((mux)->write_lock) \
+            (mux)->unlock_func((mux)->write_lock); \
+    } while (0)
+
+struct usbredirmux_buf {
+    uint8_t *data;
+    int len;
+    int pos;
+    struct usbredirmux_buf *next;
+};
+
+struct usbredirmux_channel {
+    struct usbredirmux *mux;
+    uint32_t id;
+    struct usbredirmux_buf *read_buf;
+    struct usbredirmux_buf *read_buf_tail;
+    uint64_t read_buf_bytes;
+    struct usbredirmux_buf *write_buf;
+    struct usbredirmux_buf *write_buf_tail;
+    uint64_t write_buf_bytes;
+    struct usbredirmux_channel *next;
+};
+
+struct usbredirmux {
+    usbredirparser_log log_func;
+    usbredirparser_read read_func;
+    usbredirparser_write write_func;
+    usbredirparser_lock lock_func;
+    usbredirparser_unlock unlock_func;
+    usbredirparser_free_lock free_lock_func;
+    void *func_priv;
+    int verbose;
+    void *lock;
+    void *write_lock; /* Serializes usbredirmux_do_write calls */
+
+    struct usbredirmux_channel *channels;
+    /* Channel whose turn it is to send a frame */
+    struct usbredirmux_channel *next_write_channel;
+    uint64_t write_buf_bytes;
+
+    /* Frame being received */
+    uint8_t read_header[FRAME_HEADER_LEN];
+    int read_header_len;
+    uint32_t read_channel_id;
+    struct usbredirmux_buf *read_frame;
+
+    /* Frame being send */
+    uint8_t write_frame[FRAME_HEADER_LEN + FRAME_QUANTUM];
+    int write_frame_len;
+    int write_frame_pos;
+};
+
+static void
+#if defined __GNUC__
+__attribute__((format(printf, 3, 4)))
+#endif
+va_log(struct usbredirmux *mux, int level, const char *fmt, ...)
+{
+    char buf[512];
+    va_list ap;
+    int n;
+
+    if (level > mux->verbose) {
+        return;
+    }
+
+    n = sprintf(buf, "usbredirmux: ");
+    va_start(ap, fmt);
+    vsnprintf(buf + n, sizeof(buf) - n, fmt, ap);
+    va_end(ap);
+
+    mux->log_func(mux->func_priv, level, buf);
+}
+
+#ifdef ERROR /* defined on WIN32 */
+#undef ERROR
+#endif
+#define ERROR(...)   va_log(mux, usbredirparser_error, __VA_ARGS__)
+#define WARNING(...) va_log(mux, usbredirparser_warning, __VA_ARGS__)
+#define INFO(...)    va_log(mux, usbredirparser_info, __VA_ARGS__)
+#define DEBUG(...)   va_log(mux, usbredirparser_debug, __VA_ARGS__)
+
+static void usbredirmux_put_le32(uint8_t *dest, uint32_t val)
+{
+    dest[0] = val;
+    dest[1] = val >> 8;
+    dest[2] = val >> 16;
+    dest[3] = val >> 24;
+}
+
+static uint32_t usbredirmux_get_le32(const uint8_t *src)
+{
+    return (uint32_t)src[0] | (uint32_t)src[1] << 8 |
+           (uint32_t)src[2] << 16 | (uint32_t)src[3] << 24;
+}
+
+static void usbredirmux_free_bufs(struct usbredirmux_buf *buf)
+{
+    struct usbredirmux_buf *next;
+
+    while (buf) {
+        next = buf->next;
+        free(buf->data);
+        free(buf);
+        buf = next;
+    }
+}
+
+struct usbredirmux *usbredirmux_create(
+    usbredirparser_log log_func,
+    usbredirparser_read read_func,
+    usbredirparser_write write_func,
+    usbredirparser_alloc_lock alloc_lock_func,
+    usbredirparser_lock lock_func,
+    usbredirparser_unlock unlock_func,
+    usbredirparser_free_lock free_lock_func,
+    void *func_priv, int verbose)
+{
+    struct usbredirmux *mux;
+
+    mux = calloc(1, sizeof(*mux));
+    if (!mux) {
+        log_func(func_priv, usbredirparser_error,
+            "usbredirmux error: Out of memory allocating usbredirmux");
+        return NULL;
+    }
+
+    mux->log_func = log_func;
+    mux->read_func = read_func;
+    mux->write_func = write_func;
+    mux->lock_func = lock_func;
+    mux->unlock_func = unlock_func;
+    mux->free_lock_func = free_lock_func;
+    mux->func_priv = func_priv;
+    mux->verbose = verbose;
+    if (alloc_lock_func) {
+        mux->lock = alloc_lock_func();
+        mux->write_lock = alloc_lock_func();
+    }
+
+    return mux;
+}
+
+void usbredirmux_destroy(struct usbredirmux *mux)
+{
+    if (!mux)
+        return;
+
+    while (mux->channels) {
+        usbredirmux_remove_channel(mux, mux->channels);
+    }
+    usbredirmux_free_bufs(mux->read_frame);
+
+    if (mux->lock) {
+        mux->free_lock_func(mux->lock);
+    }
+    if (mux->write_lock) {
+        mux->free_lock_func(mux->write_lock);
+    }
+    free(mux);
+}
+
+struct usbredirmux_channel *usbredirmux_add_channel(struct usbredirmux *mux,
+    uint32_t channel_id)
+{
+    struct usbredirmux_channel *channel;
+
+    LOCK(mux);
+    for (channel = mux->channels; channel; channel = channel->next) {
+        if (channel->id == channel_id) {
+            UNLOCK(mux);
+            ERROR("error channel %u is already in use", channel_id);
+            return NULL;
+        }
+    }
+
+    channel = calloc(1, sizeof(*channel));
+    if (!channel) {
+        UNLOCK(mux);
+        ERROR("Out of memory allocating channel");
+        return NULL;
+    }
+    channel->mux = mux;
+    channel->id = channel_id;
+    channel->next = mux->channels;
+    mux->channels = channel;
+    UNLOCK(mux);
+
+    return channel;
+}
+
+void usbredirmux_remove_channel(struct usbredirmux *mux,
+    struct usbredirmux_channel *channel)
+{
+    struct usbredirmux_channel **prev;
+
+    LOCK(mux);
+    for (prev = &mux->channels; *prev; prev = &(*prev)->next) {
+        if (*prev == channel) {
+            *prev = channel->next;
+            break;
+        }
+    }
+    if (mux->next_write_channel == channel) {
+        mux->next_write_channel = channel->next;
+    }
+    mux->write_buf_bytes -= channel->write_buf_bytes;
+    UNLOCK(mux);
+
+    usbredirmux_free_bufs(channel->read_buf);
+    usbredirmux_free_bufs(channel->write_buf);
+    free(channel);
+}
+
+/* Note caller must hold the mux lock */
+static struct usbredirmux_channel *usbredirmux_find_channel(
+    struct usbredirmux *mux, uint32_t channel_id)
+{
+    struct usbredirmux_channel *channel;
+
+    for (channel = mux->channels; channel; channel = channel->next) {
+        if (channel->id == channel_id)
+            break;
+    }
+    return channel;
+}
+
+/* Returns 1 if the channel of the frame being received has too much data
+   queued, in which case reading must wait until the channel has read some */
+static int usbredirmux_read_channel_full(struct usbredirmux *mux)
+{
+    struct usbredirmux_channel *channel;
+    int full;
+
+    LOCK(mux);
+    channel = usbredirmux_find_channel(mux, mux->read_channel_id);
+    full = channel && channel->read_buf_bytes >= CHANNEL_READ_BUF_MAX;
+    UNLOCK(mux);
+
+    return full;
+}
+
+/* Note caller must hold the mux lock */
+static void usbredirmux_deliver_frame(struct usbredirmux *mux)
+{
+    struct usbredirmux_channel *channel;
+    struct usbredirmux_buf *frame = mux->read_frame;
+
+    mux->read_frame = NULL;
+
+    channel = usbredirmux_find_channel(mux, mux->read_channel_id);
+    if (!channel) {
+        WARNING("discarding %d bytes for unknown channel %u",
+                frame->len, mux->read_channel_id);
+        usbredirmux_free_bufs(frame);
+        return;
+    }
+
+    frame->pos = 0;
+    if (channel->read_buf_tail) {
+        channel->read_buf_tail->next = frame;
+    } else {
+        channel->read_buf = frame;
+    }
+    channel->read_buf_tail = frame;
+    channel->read_buf_bytes += frame->len;
+}
+
+int usbredirmux_do_read(struct usbredirmux *mux)
+{
+    struct usbredirmux_buf *frame;
+    uint32_t len;
+    int r;
+
+    while (1) {
+        if (mux->read_header_len < FRAME_HEADER_LEN) {
+            r = mux->read_func(mux->func_priv,
+                               mux->read_header + mux->read_header_len,
+                               FRAME_HEADER_LEN - mux->read_header_len);
+            if (r == 0)
+                return 0;
+            if (r < 0)
+                return usbredirparser_read_io_error;
+            mux->read_header_len += r;
+            if (mux->read_header_len < FRAME_HEADER_LEN)
+                continue;
+
+            mux->read_channel_id = usbredirmux_get_le32(mux->read_header);
+            len = usbredirmux_get_le32(mux->read_header + 4);
+            if (len > FRAME_MAX_LEN) {
+                ERROR("error frame for channel %u too large (%u > %d)",
+                      mux->read_channel_id, len, FRAME_MAX_LEN);
+                mux->read_header_len = 0;
+                return usbredirparser_read_parse_error;
+            }
+            if (len == 0) {
+                mux->read_header_len = 0;
+                continue;
+            }
+        }
+
+        if (!mux->read_frame) {
+            if (usbredirmux_read_channel_full(mux))
+                return 0;
+
+            frame = calloc(1, sizeof(*frame));
+            if (frame) {
+                frame->len = usbredirmux_get_le32(mux->read_header + 4);
+                frame->data = malloc(frame->len);
+            }
+            if (!frame || !frame->data) {
+                free(frame);
+                ERROR("Out of memory allocating frame");
+                return usbredirparser_read_io_error;
+            }
+            mux->read_frame = frame;
+        }
+
+        frame = mux->read_frame;
+        r = mux->read_func(mux->func_priv, frame->data + frame->pos,
+                           frame->len - frame->pos);
+        if (r == 0)
+            return 0;
+        if (r < 0)
+            return usbredirparser_read_io_error;
+        frame->pos += r;
+        if (frame->pos < frame->len)
+            continue;
+
+        LOCK(mux);
+        usbredirmux_deliver_frame(mux);
+        UNLOCK(mux);
+        mux->read_header_len = 0;
+    }
+}
+
+uint64_t usbredirmux_has_data_to_write(struct usbredirmux *mux)
+{
+    uint64_t bytes;
+
+    LOCK(mux);
+    bytes = mux->write_buf_bytes +
+            (mux->write_frame_len - mux->write_frame_pos);
+    UNLOCK(mux);
+
+    return bytes;
+}
+
+/* Fill write_frame with the data of the next channel in line.
+   Note caller must hold the mux lock */
+static int usbredirmux_next_write_frame(struct usbredirmux *mux)
+{
+    struct usbredirmux_channel *channel, *start;
+    struct usbredirmux_buf *buf;
+    int n, len = 0;
+
+    if (!mux->write_buf_bytes)
+        return 0;
+
+    start = mux->next_write_channel ? mux->next_write_channel : mux->channels;
+    channel = start;
+    while (!channel->write_buf_bytes) {
+        channel = channel->next ? channel->next : mux->channels;
+        if (channel == start)
+            return 0;
+    }
+    mux->next_write_channel = channel->next;
+
+    while (len < FRAME_QUANTUM && (buf = channel->write_buf)) {
+        n = buf->len - buf->pos;
+        if (n > FRAME_QUANTUM - len)
+            n = FRAME_QUANTUM - len;
+        memcpy(mux->write_frame + FRAME_HEADER_LEN + len,
+               buf->data + buf->pos, n);
+        buf->pos += n;
+        len += n;
+        if (buf->pos == buf->len) {
+            channel->write_buf = buf->next;
+            if (!channel->write_buf)
+                channel->write_buf_tail = NULL;
+            free(buf->data);
+            free(buf);
+        }
+    }
+    channel->write_buf_bytes -= len;
+    mux->write_buf_bytes -= len;
+
+    usbredirmux_put_le32(mux->write_frame, channel->id);
+    usbredirmux_put_le32(mux->write_frame + 4, len);
+    mux->write_frame_len = FRAME_HEADER_LEN + len;
+    mux->write_frame_pos = 0;
+    return 1;
+}
+
+/* The write callback gets called with the mux lock dropped, so that the
+   channels can keep queueing and reading data meanwhile. write_frame is
+   only touched by usbredirmux_do_write, the write lock keeps other writers
+   out. */
+int usbredirmux_do_write(struct usbredirmux *mux)
+{
+    int w, ret = 0;
+
+    WRITE_LOCK(mux);
+    LOCK(mux);
+    for (;;) {
+        if (mux->write_frame_pos == mux->write_frame_len &&
+                !usbredirmux_next_write_frame(mux))
+            break;
+
+        UNLOCK(mux);
+        w = mux->write_func(mux->func_priv,
+                            mux->write_frame + mux->write_frame_pos,
+                            mux->write_frame_len - mux->write_frame_pos);
+        LOCK(mux);
+        if (w == 0)
+            break;
+        if (w < 0) {
+            ret = usbredirparser_write_io_error;
+            break;
+        }
+        mux->write_frame_pos += w;
+    }
+    UNLOCK(mux);
+    WRITE_UNLOCK(mux);
+
+    return ret;
+}
+
+int usbredirmux_channel_read(struct usbredirmux_channel *channel,
+    uint8_t *data, int count)
+{
+    struct usbredirmux *mux = channel->mux;
+    struct usbredirmux_buf *buf;
+    int n, r = 0;
+
+    LOCK(mux);
+    while (r < count && (buf = channel->read_buf)) {
+        n = buf->len - buf->pos;
+        if (n > count - r)
+            n = count - r;
+        memcpy(data + r, buf->data + buf->pos, n);
+        buf->pos += n;
+        r += n;
+        channel->read_buf_bytes -= n;
+        if (buf->pos == buf->len) {
+            channel->read_buf = buf->next;
+            if (!channel->read_buf)
+                channel->read_buf_tail = NULL;
+            free(buf->data);
+            free(buf);
+        }
+    }
+    UNLOCK(mux);
+
+    return r;
+}
+
+int usbredirmux_channel_write(struct usbredirmux_channel *channel,
+    uint8_t *data, int count)
+{
+    struct usbredirmux *mux = channel->mux;
+    struct usbredirmux_buf *buf;
+
+    LOCK(mux);
+    if (channel->write_buf_bytes >= CHANNEL_WRITE_BUF_MAX) {
+        UNLOCK(mux);
+        return 0;
+    }
+
+    buf = calloc(1, sizeof(*buf));
+    if (buf) {
+        buf->data = malloc(count);
+    }
+    if (!buf || !buf->data) {
+        UNLOCK(mux);
+        free(buf);
+        ERROR("Out of memory allocating write buffer");
+        return -1;
+    }
+    memcpy(buf->data, data, count);
+    buf->len = count;
+
+    if (channel->write_buf_tail) {
+        channel->write_buf_tail->next = buf;
+    } else {
+        channel->write_buf = buf;
+    }
+    channel->write_buf_tail = buf;
+    channel->write_buf_bytes += count;
+    mux->write_buf_bytes += count;
+    UNLOCK(mux);
+
+    return count;
+}
@@ -0,0 +1,100 @@
+/* usbredirmux.h usb redirection connection multiplexer header
+
+   Copyright 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __USBREDIRMUX_H
+#define __USBREDIRMUX_H
+
+#include "usbredirparser.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The usbredirmux carries the usbredir streams of multiple redirected
+   devices over a single transport connection. Each device gets a channel,
+   identified by a channel id agreed upon out of band by the 2 sides. The
+   byte stream of each channel is cut into frames which are sent interleaved
+   in a round robin fashion, see usb-redirection-protocol.txt for the frame
+   format.
+
+   A channel is used by the per device usbredirparser / usbredirhost by
+   calling usbredirmux_channel_read / usbredirmux_channel_write from its
+   read / write callbacks, so the per device semantics (including write
+   watermarks) are unchanged. Note the usbredirparser_fl_write_cb_owns_buffer
+   flag cannot be used on a channel. */
+struct usbredirmux;
+struct usbredirmux_channel;
+
+/* Create a mux, read_func and write_func are used to read / write from the
+   shared transport and must follow the usbredirparser_read / write
+   semantics. The lock functions are optional, see README.multi-thread */
+struct usbredirmux *usbredirmux_create(
+    usbredirparser_log log_func,
+    usbredirparser_read read_func,
+    usbredirparser_write write_func,
+    usbredirparser_alloc_lock alloc_lock_func,
+    usbredirparser_lock lock_func,
+    usbredirparser_unlock unlock_func,
+    usbredirparser_free_lock free_lock_func,
+    void *func_priv, int verbose);
+
+/* Also removes any channels still present */
+void usbredirmux_destroy(struct usbredirmux *mux);
+
+/* Returns NULL when out of memory or if the channel id is already in use */
+struct usbredirmux_channel *usbredirmux_add_channel(struct usbredirmux *mux,
+    uint32_t channel_id);
+
+/* Discards any data queued on the channel in either direction */
+void usbredirmux_remove_channel(struct usbredirmux *mux,
+    struct usbredirmux_channel *channel);
+
+/* Call this whenever there is data ready from the transport, this demuxes
+   it to the channels, after which the app should call do_read on the
+   parsers (or read_guest_data on the hosts) of the channels. Data for
+   unknown channels is discarded. Reading stops when the next frame is for
+   a channel which has too much data waiting to be read, the app should
+   call this again after the channel's parser has read some of it.
+   Returns 0 on success or when the read would block, or one of the
+   usbredirparser_read_* errors. After a usbredirparser_read_parse_error
+   the framing is lost and the connection should be closed. */
+int usbredirmux_do_read(struct usbredirmux *mux);
+
+/* This returns the number of bytes queued for writing on all channels */
+uint64_t usbredirmux_has_data_to_write(struct usbredirmux *mux);
+
+/* Call this when usbredirmux_has_data_to_write returns > 0, this writes
+   frames taking turns between the channels until all data is written or the
+   transport would block. Afterwards the app should call do_write on any
+   channel parsers which still have data to write, as channel writes block
+   while too much data is queued on a channel.
+   Returns 0 on success, or usbredirparser_write_io_error. */
+int usbredirmux_do_write(struct usbredirmux *mux);
+
+/* For use from the read / write callbacks of the usbredirparser (or
+   usbredirhost) of a channel, same semantics as usbredirparser_read /
+   usbredirparser_write */
+int usbredirmux_channel_read(struct usbredirmux_channel *channel,
+    uint8_t *data, int count);
+int usbredirmux_channel_write(struct usbredirmux_channel *channel,
+    uint8_t *data, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -24,6 +24,15 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <limits.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 #include "usbredirproto-compat.h"
 #include "usbredirparser.h"
 #include "usbredirfilter.h"
@@ -31,6 +40,39 @@
 /* Put *some* upper limit on bulk transfer sizes */
 #define MAX_BULK_TRANSFER_SIZE (128u * 1024u * 1024u)
 
+/* Size of the receive buffer used by usbredirparser_do_read, payloads which
+   are at least this large get read directly into their packet data buffer */
+#define READ_BUF_SIZE 65536
+/* Max length of a compact header, a 5 byte type and length and a 10 byte id */
+#define COMPACT_HEADER_MAX_LEN 20
+/* Compact header ids are deltas per endpoint, plus 1 for other packets */
+#define COMPACT_ID_SLOTS 33
+#define EP_SLOT(ep) ((((ep) & 0x80) >> 3) | ((ep) & 0x0f))
+/* Slot of the packets which are not tied to an endpoint */
+#define NO_EP_SLOT (COMPACT_ID_SLOTS - 1)
+/* Bulk packet data shorter than this is never compressed */
+#define COMPRESS_MIN_LEN 512
+/* After this many incompressible packets in a row on an endpoint, the data
+   of the next COMPRESS_BACKOFF packets on it gets send without trying */
+#define COMPRESS_MAX_FAILURES 4
+#define COMPRESS_BACKOFF 64
+
+/* Max number of queued packets passed to a single writev_func call */
+#define WRITEV_MAX_IOV 64
+/* Data packets of an endpoint with a write weight of 1 get to send this
+   many bytes per turn, see usbredirparser_next_write_slot */
+#define WRITE_QUANTUM 16384
+/* Packets are moved to the write queue when there are less than this many
+   bytes in it, so that control and status packets queued later do not have
+   to wait behind more data than this */
+#define WRITE_STAGE_BYTES 16384
+#define MAX_WRITE_WEIGHT 256
+
+/* Room reserved in front of the data of buffers from
+   usbredirparser_alloc_packet_buffer, this must be large enough for the
+   (64 bits id) header + the largest data packet type header */
+#define PACKET_BUF_HEADROOM 32
+
 /* Locking convenience macros */
 #define LOCK(parser) \
     do { \
@@ -44,14 +86,90 @@
             (parser)->callb.unlock_func((parser)->lock); \
     } while (0)
 
+#define WRITE_LOCK(parser) \
+    do { \
+        if ((parser)->write_lock) \
+            (parser)->callb.lock_func((parser)->write_lock); \
+    } while (0)
+
+#define WRITE_UNLOCK(parser) \
+    do { \
+        if ((parser)->write_lock) \
+            (parser)->callb.unlock_func((parser)->write_lock); \
+    } while (0)
+
+#define POOL_LOCK(parser) \
+    do { \
+        if ((parser)->pool_lock) \
+            (parser)->callb.lock_func((parser)->pool_lock); \
+    } while (0)
+
+#define POOL_UNLOCK(parser) \
+    do { \
+        if ((parser)->pool_lock) \
+            (parser)->callb.unlock_func((parser)->pool_lock); \
+    } while (0)
+
+#define COMPRESS_LOCK(parser) \
+    do { \
+        if ((parser)->compress_lock) \
+            (parser)->callb.lock_func((parser)->compress_lock); \
+    } while (0)
+
+#define COMPRESS_UNLOCK(parser) \
+    do { \
+        if ((parser)->compress_lock) \
+            (parser)->callb.unlock_func((parser)->compress_lock); \
+    } while (0)
+
+/* Buffer pool size classes, these follow common packet data sizes (HID
+   reports, 512 byte bulk packets, iso packets, larger bulk transfers).
+   Each class has POOL_SLACK extra bytes, so that a write buffer holding the
+   header + type header + data of such a packet fits in the same class. */
+#define POOL_CLASSES 7
+#define POOL_SLACK 64
+
+static const int usbredirparser_pool_size[POOL_CLASSES] = {
+    8, 64, 512, 1024, 3072, 16384, 65536 };
+/* Max number of free buffers kept per class, anything above this is
+   returned to the system allocator */
+static const int usbredirparser_pool_max[POOL_CLASSES] = {
+    64, 64, 32, 32, 32, 8, 2 };
+
+struct usbredirparser_pool_chunk {
+    struct usbredirparser_pool_chunk *next;
+    int size_class; /* -1 for buffers too large for any class */
+};
+
 struct usbredirparser_buf {
     uint8_t *buf;
     int pos;
     int len;
+    uint64_t time; /* When the packet was queued, see usbredirparser_time */
+    uint64_t seq; /* Order in which the packets were queued */
+    uint64_t expires; /* 0 if the packet never expires */
+    int started; /* Part of the packet has been written */
+    int writing; /* Passed to the write callback, which is in progress */
+    int ep_type; /* Endpoint type whose ttl applies to the packet */
+    int type; /* Packet type, -1 for unserialized packets */
+    int slot; /* Id slot, -1 for unserialized packets */
+};
 
-    struct usbredirparser_buf *next;
+/* Ring of packets queued for writing, count entries starting at head,
+   size is 0 or a power of 2 */
+struct usbredirparser_wqueue {
+    struct usbredirparser_buf *buf;
+    int size;
+    int head;
+    int count;
 };
 
+/* Get the i-th packet of a write queue */
+#define WQBUF(q, i) (&(q)->buf[((q)->head + (i)) & ((q)->size - 1)])
+
+/* Get the i-th packet of the queue of packets being written */
+#define WBUF(parser, i) WQBUF(&(parser)->write_queue, i)
+
 struct usbredirparser_priv {
     struct usbredirparser callb;
     int flags;
@@ -61,11 +179,21 @@ struct usbredirparser_priv {
     uint32_t peer_caps[USB_REDIR_CAPS_SIZE];
 
     void *lock;
+    /* Serializes writers, which drop the lock while calling the write
+       callback, so that senders do not have to wait for the transport */
+    void *write_lock;
 
     union {
         struct usb_redir_header header;
         struct usb_redir_header_32bit_id header_32bit_id;
     };
+    /* With usb_redir_cap_compact_header the header gets read into
+       compact_header, and decoded into header once complete */
+    uint8_t compact_header[COMPACT_HEADER_MAX_LEN];
+    uint64_t compact_id_delta;
+    /* Last ids send / received per endpoint, see usbredirparser_get_id_slot */
+    uint64_t send_ids[COMPACT_ID_SLOTS];
+    uint64_t recv_ids[COMPACT_ID_SLOTS];
     uint8_t type_header[256];
     int header_read;
     int type_header_len;
@@ -73,9 +201,53 @@ struct usbredirparser_priv {
     uint8_t *data;
     int data_len;
     int data_read;
+    int data_placed; /* data points to memory from place_packet_data_func */
+    int data_borrowed; /* data points into the buffer being parsed */
+    /* Bulk packet being passed to the app in chunks, data_len is the
+       length of the current chunk */
+    int data_chunked;
+    uint32_t chunk_offset;
+    uint32_t chunk_remain; /* Bytes of data following the current chunk */
     int to_skip;
-    struct usbredirparser_buf *write_buf;
-    int write_buf_count;
+    /* Data read from the transport, but not yet parsed */
+    uint8_t *read_buf;
+    int read_buf_pos;
+    int read_buf_len;
+    /* Packets get queued per id slot, and moved to the write_queue by
+       usbredirparser_stage_packets shortly before being written */
+    struct usbredirparser_wqueue write_queue;
+    struct usbredirparser_wqueue slot_queue[COMPACT_ID_SLOTS];
+    int slot_queued; /* Packets in all slot_queue-s together */
+    uint64_t write_seq; /* seq of the next packet to queue */
+    int write_weight[COMPACT_ID_SLOTS]; /* 0 for the default weight of 1 */
+    int64_t write_deficit[COMPACT_ID_SLOTS];
+    int write_rr_slot;
+    int batch_depth; /* Nesting level of begin_batch calls */
+    uint64_t write_buf_bytes;
+    uint64_t write_high_watermark;
+    uint64_t write_low_watermark;
+    int write_above_high_watermark;
+    int write_watermark_reported; /* Last state passed to the app */
+    int write_watermark_calling; /* A thread is calling write_watermark_func */
+    /* Per endpoint type time to live of queued input stream packets */
+    uint32_t packet_ttl[4];
+    uint64_t expired_packets[4];
+    /* Buffer pool, used when the app has not set its own allocator */
+    void *pool_lock;
+    struct usbredirparser_pool_chunk *pool[POOL_CLASSES];
+    int pool_count[POOL_CLASSES];
+    uint64_t pool_hits;
+    uint64_t pool_misses;
+    uint64_t pool_overflows;
+    struct usbredirparser_compression_stats compression_stats;
+    /* Compression state, protected by compress_lock */
+    void *compress_lock;
+#ifdef HAVE_ZLIB
+    z_stream deflate_stream;
+    int deflate_initialized;
+#endif
+    int compress_failures[32]; /* Incompressible packets in a row per ep */
+    int compress_skip[32]; /* Packets to send without trying per ep */
 };
 
 static void
@@ -96,37 +268,197 @@ va_log(struct usbredirparser_priv *parser, int verbose, const char *fmt, ...)
     parser->callb.log_func(parser->callb.priv, verbose, buf);
 }
 
+#ifdef ERROR /* defined on WIN32 */
+#undef ERROR
+#endif
 #define ERROR(...)   va_log(parser, usbredirparser_error, __VA_ARGS__)
 #define WARNING(...) va_log(parser, usbredirparser_warning, __VA_ARGS__)
 #define INFO(...)    va_log(parser, usbredirparser_info, __VA_ARGS__)
 #define DEBUG(...)    va_log(parser, usbredirparser_debug, __VA_ARGS__)
 
+/* Monotonic time in microseconds */
+static uint64_t usbredirparser_time(void)
+{
+#ifdef WIN32
+    return (uint64_t)GetTickCount64() * 1000;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static void *usbredirparser_pool_alloc(struct usbredirparser_priv *parser,
+    size_t size)
+{
+    struct usbredirparser_pool_chunk *chunk = NULL;
+    int c;
+
+    for (c = 0; c < POOL_CLASSES; c++) {
+        if (size <= usbredirparser_pool_size[c] + POOL_SLACK)
+            break;
+    }
+
+    POOL_LOCK(parser);
+    if (c < POOL_CLASSES && parser->pool[c]) {
+        chunk = parser->pool[c];
+        parser->pool[c] = chunk->next;
+        parser->pool_count[c]--;
+        parser->pool_hits++;
+    } else {
+        parser->pool_misses++;
+    }
+    POOL_UNLOCK(parser);
+
+    if (!chunk) {
+        if (c < POOL_CLASSES) {
+            size = usbredirparser_pool_size[c] + POOL_SLACK;
+        } else {
+            c = -1;
+        }
+        chunk = malloc(sizeof(*chunk) + size);
+        if (!chunk)
+            return NULL;
+        chunk->size_class = c;
+    }
+    return chunk + 1;
+}
+
+static void usbredirparser_pool_free(struct usbredirparser_priv *parser,
+    void *ptr)
+{
+    struct usbredirparser_pool_chunk *chunk =
+        (struct usbredirparser_pool_chunk *)ptr - 1;
+    int c = chunk->size_class;
+
+    POOL_LOCK(parser);
+    if (c != -1 && parser->pool_count[c] < usbredirparser_pool_max[c]) {
+        chunk->next = parser->pool[c];
+        parser->pool[c] = chunk;
+        parser->pool_count[c]++;
+        chunk = NULL;
+    } else {
+        parser->pool_overflows++;
+    }
+    POOL_UNLOCK(parser);
+
+    free(chunk);
+}
+
+static void *usbredirparser_pool_realloc(struct usbredirparser_priv *parser,
+    void *ptr, size_t size)
+{
+    struct usbredirparser_pool_chunk *chunk;
+    void *new_ptr;
+    int c;
+
+    if (!ptr)
+        return usbredirparser_pool_alloc(parser, size);
+
+    chunk = (struct usbredirparser_pool_chunk *)ptr - 1;
+    c = chunk->size_class;
+    if (c == -1) {
+        chunk = realloc(chunk, sizeof(*chunk) + size);
+        return chunk ? chunk + 1 : NULL;
+    }
+    if (size <= usbredirparser_pool_size[c] + POOL_SLACK)
+        return ptr;
+
+    new_ptr = usbredirparser_pool_alloc(parser, size);
+    if (!new_ptr)
+        return NULL;
+    memcpy(new_ptr, ptr, usbredirparser_pool_size[c] + POOL_SLACK);
+    usbredirparser_pool_free(parser, ptr);
+    return new_ptr;
+}
+
+static void usbredirparser_pool_drain(struct usbredirparser_priv *parser)
+{
+    struct usbredirparser_pool_chunk *chunk;
+    int c;
+
+    for (c = 0; c < POOL_CLASSES; c++) {
+        while (parser->pool[c]) {
+            chunk = parser->pool[c];
+            parser->pool[c] = chunk->next;
+            free(chunk);
+        }
+        parser->pool_count[c] = 0;
+    }
+}
+
+/* Memory allocation wrappers, these use the app's allocator when it has
+   set one (see usbredirparser_alloc_mem), the buffer pool when enabled with
+   usbredirparser_fl_buffer_pool and malloc otherwise */
+static void *usbredirparser_mem_alloc(struct usbredirparser_priv *parser,
+    size_t size, int type)
+{
+    if (parser->callb.alloc_mem_func)
+        return parser->callb.alloc_mem_func(parser->callb.priv, size, type);
+    if (!(parser->flags & usbredirparser_fl_buffer_pool))
+        return malloc(size);
+    return usbredirparser_pool_alloc(parser, size);
+}
+
+static void *usbredirparser_mem_realloc(struct usbredirparser_priv *parser,
+    void *ptr, size_t size, int type)
+{
+    if (parser->callb.realloc_mem_func)
+        return parser->callb.realloc_mem_func(parser->callb.priv, ptr,
+                                              size, type);
+    if (!(parser->flags & usbredirparser_fl_buffer_pool))
+        return realloc(ptr, size);
+    return usbredirparser_pool_realloc(parser, ptr, size);
+}
+
+static void usbredirparser_mem_free(struct usbredirparser_priv *parser,
+    void *ptr)
+{
+    if (!ptr)
+        return;
+    if (parser->callb.free_mem_func)
+        parser->callb.free_mem_func(parser->callb.priv, ptr);
+    else if (!(parser->flags & usbredirparser_fl_buffer_pool))
+        free(ptr);
+    else
+        usbredirparser_pool_free(parser, ptr);
+}
+
+/* Free all packets in a write queue, keeping the ring itself */
+static void usbredirparser_wqueue_clear(struct usbredirparser_priv *parser,
+    struct usbredirparser_wqueue *q)
+{
+    int i;
+
+    for (i = 0; i < q->count; i++)
+        usbredirparser_mem_free(parser, WQBUF(q, i)->buf);
+    q->head = 0;
+    q->count = 0;
+}
+
 #if 0 /* Can be enabled and called from random place to test serialization */
 static void serialize_test(struct usbredirparser *parser_pub)
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
-    struct usbredirparser_buf *wbuf, *next_wbuf;
     uint8_t *data;
-    int len;
+    int i, len;
 
     if (usbredirparser_serialize(parser_pub, &data, &len))
         return;
 
-    wbuf = parser->write_buf;
-    while (wbuf) {
-        next_wbuf = wbuf->next;
-        free(wbuf->buf);
-        free(wbuf);
-        wbuf = next_wbuf;
-    }
-    parser->write_buf = NULL;
-    parser->write_buf_count = 0;
+    usbredirparser_wqueue_clear(parser, &parser->write_queue);
+    for (i = 0; i < COMPACT_ID_SLOTS; i++)
+        usbredirparser_wqueue_clear(parser, &parser->slot_queue[i]);
+    parser->slot_queued = 0;
+    parser->write_buf_bytes = 0;
 
-    free(parser->data);
+    usbredirparser_mem_free(parser, parser->data);
     parser->data = NULL;
 
     parser->type_header_len = parser->data_len = parser->have_peer_caps = 0;
+    parser->read_buf_pos = parser->read_buf_len = 0;
 
     usbredirparser_unserialize(parser_pub, data, len);
     free(data);
@@ -151,6 +483,9 @@ void usbredirparser_init(struct usbredirparser *parser_pub,
     parser->flags = (flags & ~usbredirparser_fl_no_hello);
     if (parser->callb.alloc_lock_func) {
         parser->lock = parser->callb.alloc_lock_func();
+        parser->write_lock = parser->callb.alloc_lock_func();
+        if (flags & usbredirparser_fl_buffer_pool)
+            parser->pool_lock = parser->callb.alloc_lock_func();
     }
 
     snprintf(hello.version, sizeof(hello.version), "%s", version);
@@ -162,6 +497,14 @@ void usbredirparser_init(struct usbredirparser *parser_pub,
     if (!(flags & usbredirparser_fl_usb_host))
         usbredirparser_caps_set_cap(parser->our_caps,
                                     usb_redir_cap_device_disconnect_ack);
+#ifndef HAVE_ZLIB
+    /* Compression support is optional at build time */
+    parser->our_caps[usb_redir_cap_compression / 32] &=
+        ~(1 << (usb_redir_cap_compression % 32));
+#endif
+    if (parser->callb.alloc_lock_func &&
+            usbredirparser_have_cap(parser_pub, usb_redir_cap_compression))
+        parser->compress_lock = parser->callb.alloc_lock_func();
     if (!(flags & usbredirparser_fl_no_hello))
         usbredirparser_queue(parser_pub, usb_redir_hello, 0, &hello,
                              (uint8_t *)parser->our_caps,
@@ -172,18 +515,31 @@ void usbredirparser_destroy(struct usbredirparser *parser_pub)
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
-    struct usbredirparser_buf *wbuf, *next_wbuf;
+    int i;
 
-    wbuf = parser->write_buf;
-    while (wbuf) {
-        next_wbuf = wbuf->next;
-        free(wbuf->buf);
-        free(wbuf);
-        wbuf = next_wbuf;
+    usbredirparser_wqueue_clear(parser, &parser->write_queue);
+    usbredirparser_mem_free(parser, parser->write_queue.buf);
+    for (i = 0; i < COMPACT_ID_SLOTS; i++) {
+        usbredirparser_wqueue_clear(parser, &parser->slot_queue[i]);
+        usbredirparser_mem_free(parser, parser->slot_queue[i].buf);
     }
 
+    usbredirparser_mem_free(parser, parser->data);
+    usbredirparser_mem_free(parser, parser->read_buf);
+    usbredirparser_pool_drain(parser);
+#ifdef HAVE_ZLIB
+    if (parser->deflate_initialized)
+        deflateEnd(&parser->deflate_stream);
+#endif
+
     if (parser->lock)
         parser->callb.free_lock_func(parser->lock);
+    if (parser->write_lock)
+        parser->callb.free_lock_func(parser->write_lock);
+    if (parser->pool_lock)
+        parser->callb.free_lock_func(parser->pool_lock);
+    if (parser->compress_lock)
+        parser->callb.free_lock_func(parser->compress_lock);
 
     free(parser);
 }
@@ -259,7 +615,7 @@ static void usbredirparser_handle_hello(struct usbredirparser *parser_pub,
         parser->peer_caps[i] = peer_caps[i];
     }
     parser->have_peer_caps = 1;
-    free(data);
+    usbredirparser_mem_free(parser, data);
 
     INFO("Peer version: %s, using %d-bits ids", buf,
          usbredirparser_using_32bits_ids(parser_pub) ? 32 : 64);
@@ -269,6 +625,30 @@ static void usbredirparser_handle_hello(struct usbredirparser *parser_pub,
         parser->callb.hello_func(parser->callb.priv, hello);
 }
 
+static int usbredirparser_using_compact_header(
+    struct usbredirparser *parser_pub)
+{
+    return usbredirparser_have_cap(parser_pub,
+                                   usb_redir_cap_compact_header) &&
+           usbredirparser_peer_has_cap(parser_pub,
+                                       usb_redir_cap_compact_header);
+}
+
+/* Get the id of the packet being parsed */
+static uint64_t usbredirparser_get_id(struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    if (usbredirparser_using_compact_header(parser_pub))
+        return parser->header.id; /* see usbredirparser_resolve_id */
+    else if (usbredirparser_using_32bits_ids(parser_pub))
+        return parser->header_32bit_id.id;
+    else
+        return parser->header.id;
+}
+
+/* Get the length of the (not compact) header */
 static int usbredirparser_get_header_len(struct usbredirparser *parser_pub)
 {
     if (usbredirparser_using_32bits_ids(parser_pub))
@@ -277,6 +657,216 @@ static int usbredirparser_get_header_len(struct usbredirparser *parser_pub)
         return sizeof(struct usb_redir_header);
 }
 
+/**************************************************************************/
+/* Compact header support, a compact header consists of 3 LEB128 varints:
+   the type, the length, and the zigzag encoded difference between the id
+   and the id of the previous packet for the same endpoint. */
+
+static int usbredirparser_put_varint(uint8_t *buf, uint64_t val)
+{
+    int len = 0;
+
+    while (val >= 0x80) {
+        buf[len++] = val | 0x80;
+        val >>= 7;
+    }
+    buf[len++] = val;
+    return len;
+}
+
+/* Returns the index into the send_ids / recv_ids arrays for a packet */
+static int usbredirparser_get_id_slot(int32_t type, void *type_header)
+{
+    uint8_t ep;
+
+    switch (type) {
+    case usb_redir_start_iso_stream:
+        ep = ((struct usb_redir_start_iso_stream_header *)
+              type_header)->endpoint;
+        break;
+    case usb_redir_stop_iso_stream:
+        ep = ((struct usb_redir_stop_iso_stream_header *)
+              type_header)->endpoint;
+        break;
+    case usb_redir_iso_stream_status:
+        ep = ((struct usb_redir_iso_stream_status_header *)
+              type_header)->endpoint;
+        break;
+    case usb_redir_start_interrupt_receiving:
+        ep = ((struct usb_redir_start_interrupt_receiving_header *)
+              type_header)->endpoint;
+        break;
+    case usb_redir_stop_interrupt_receiving:
+        ep = ((struct usb_redir_stop_interrupt_receiving_header *)
+              type_header)->endpoint;
+        break;
+    case usb_redir_interrupt_receiving_status:
+        ep = ((struct usb_redir_interrupt_receiving_status_header *)
+              type_header)->endpoint;
+        break;
+    case usb_redir_start_bulk_receiving:
+        ep = ((struct usb_redir_start_bulk_receiving_header *)
+              type_header)->endpoint;
+        break;
+    case usb_redir_stop_bulk_receiving:
+        ep = ((struct usb_redir_stop_bulk_receiving_header *)
+              type_header)->endpoint;
+        break;
+    case usb_redir_bulk_receiving_status:
+        ep = ((struct usb_redir_bulk_receiving_status_header *)
+              type_header)->endpoint;
+        break;
+    case usb_redir_ep_credits:
+        ep = ((struct usb_redir_ep_credits_header *)type_header)->endpoint;
+        break;
+    case usb_redir_control_packet:
+        ep = ((struct usb_redir_control_packet_header *)
+              type_header)->endpoint;
+        break;
+    case usb_redir_bulk_packet: /* Same offset with a 16 bits length */
+        ep = ((struct usb_redir_bulk_packet_header *)type_header)->endpoint;
+        break;
+    case usb_redir_iso_packet:
+        ep = ((struct usb_redir_iso_packet_header *)type_header)->endpoint;
+        break;
+    case usb_redir_interrupt_packet:
+        ep = ((struct usb_redir_interrupt_packet_header *)
+              type_header)->endpoint;
+        break;
+    case usb_redir_buffered_bulk_packet:
+        ep = ((struct usb_redir_buffered_bulk_packet_header *)
+              type_header)->endpoint;
+        break;
+    case usb_redir_multi_iso_packet:
+        ep = ((struct usb_redir_multi_iso_packet_header *)
+              type_header)->endpoint;
+        break;
+    default:
+        return NO_EP_SLOT;
+    }
+    return EP_SLOT(ep);
+}
+
+/* Scan the compact header bytes read so far. Returns the length of the
+   header, or if it is not complete yet the minimum length it can have, or
+   -1 if it is invalid. If the header is complete its fields are stored in
+   vals and *complete gets set to 1. */
+static int usbredirparser_scan_compact_header(
+    struct usbredirparser_priv *parser, uint64_t *vals, int *complete)
+{
+    static const int max_len[3] = { 5, 5, 10 };
+    int i, shift, pos = 0;
+
+    *complete = 0;
+    for (i = 0; i < 3; i++) {
+        vals[i] = 0;
+        for (shift = 0; ; shift += 7) {
+            if (pos == parser->header_read)
+                return pos + 3 - i; /* 1 more byte for this and the rest */
+            if (shift == max_len[i] * 7)
+                return -1;
+            vals[i] |= (uint64_t)(parser->compact_header[pos] & 0x7f) << shift;
+            if (!(parser->compact_header[pos++] & 0x80))
+                break;
+        }
+    }
+    if (vals[0] > UINT32_MAX || vals[1] > UINT32_MAX)
+        return -1;
+    *complete = 1;
+    return pos;
+}
+
+/* Get the length of the header being read */
+static int usbredirparser_get_read_header_len(
+    struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    uint64_t vals[3];
+    int complete, len;
+
+    if (!usbredirparser_using_compact_header(parser_pub))
+        return usbredirparser_get_header_len(parser_pub);
+
+    len = usbredirparser_scan_compact_header(parser, vals, &complete);
+    return (len < 0) ? parser->header_read : len;
+}
+
+/* Called after reading header bytes, if the compact header is complete
+   this decodes it into parser->header. Returns 1 if complete, 0 if more
+   bytes are needed, -1 if the header is invalid */
+static int usbredirparser_decode_compact_header(
+    struct usbredirparser_priv *parser)
+{
+    uint64_t vals[3];
+    int complete;
+
+    if (usbredirparser_scan_compact_header(parser, vals, &complete) < 0)
+        return -1;
+    if (!complete)
+        return 0;
+
+    parser->header.type = vals[0];
+    parser->header.length = vals[1];
+    parser->compact_id_delta = (vals[2] >> 1) ^ -(vals[2] & 1);
+    return 1;
+}
+
+/* Called once the type header of a packet has been read, to turn the id
+   delta of a compact header into the id */
+static void usbredirparser_resolve_id(struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    uint64_t id;
+    int slot;
+
+    if (!usbredirparser_using_compact_header(parser_pub))
+        return;
+
+    slot = usbredirparser_get_id_slot(parser->header.type,
+                                      parser->type_header);
+    id = parser->recv_ids[slot] + parser->compact_id_delta;
+    if (usbredirparser_using_32bits_ids(parser_pub))
+        id &= UINT32_MAX;
+    parser->recv_ids[slot] = id;
+    parser->header.id = id;
+}
+
+/* Replace the header of a packet queued at buf + pos with a compact header,
+   returns the new start of the packet. The compact header is never longer
+   than the normal header, as all packet types are < 128.
+   Note caller must hold the parser lock, so that packets get queued in the
+   order of their id deltas. */
+static int usbredirparser_compact_header(struct usbredirparser *parser_pub,
+    uint8_t *buf, int pos)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    struct usb_redir_header *header = (struct usb_redir_header *)(buf + pos);
+    int slot, len, header_len = usbredirparser_get_header_len(parser_pub);
+    uint8_t compact_header[COMPACT_HEADER_MAX_LEN];
+    uint64_t id, delta;
+
+    if (usbredirparser_using_32bits_ids(parser_pub))
+        id = ((struct usb_redir_header_32bit_id *)header)->id;
+    else
+        id = header->id;
+
+    slot = usbredirparser_get_id_slot(header->type, buf + pos + header_len);
+    delta = id - parser->send_ids[slot];
+    parser->send_ids[slot] = id;
+
+    len = usbredirparser_put_varint(compact_header, header->type);
+    len += usbredirparser_put_varint(compact_header + len, header->length);
+    len += usbredirparser_put_varint(compact_header + len,
+                                     (delta << 1) ^ -(delta >> 63));
+
+    pos += header_len - len;
+    memcpy(buf + pos, compact_header, len);
+    return pos;
+}
+
 static int usbredirparser_get_type_header_len(
     struct usbredirparser *parser_pub, int32_t type, int send)
 {
@@ -466,6 +1056,12 @@ static int usbredirparser_get_type_header_len(
         } else {
             return -1;
         }
+    case usb_redir_ep_credits:
+        if (command_for_host) {
+            return sizeof(struct usb_redir_ep_credits_header);
+        } else {
+            return -1;
+        }
     case usb_redir_control_packet:
         return sizeof(struct usb_redir_control_packet_header);
     case usb_redir_bulk_packet:
@@ -487,11 +1083,29 @@ static int usbredirparser_get_type_header_len(
         } else {
             return -1;
         }
+    case usb_redir_multi_iso_packet:
+        return sizeof(struct usb_redir_multi_iso_packet_header);
     default:
         return -1;
     }
 }
 
+/* Data packets as opposed to control packets */
+static int usbredirparser_is_data_packet(int32_t type)
+{
+    switch (type) {
+    case usb_redir_control_packet:
+    case usb_redir_bulk_packet:
+    case usb_redir_iso_packet:
+    case usb_redir_interrupt_packet:
+    case usb_redir_buffered_bulk_packet:
+    case usb_redir_multi_iso_packet:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
 /* Note this function only checks if extra data is allowed for the
    packet type being read at all, a check if it is actually allowed
    given the direction of the packet + ep is done in _erify_type_header */
@@ -505,6 +1119,7 @@ static int usbredirparser_expect_extra_data(struct usbredirparser_priv *parser)
     case usb_redir_iso_packet:
     case usb_redir_interrupt_packet:
     case usb_redir_buffered_bulk_packet:
+    case usb_redir_multi_iso_packet:
         return 1;
     default:
         return 0;
@@ -527,6 +1142,37 @@ static int usbredirparser_verify_bulk_recv_cap(
     return 1; /* Verify ok */
 }
 
+static int usbredirparser_verify_multi_iso_data(
+    struct usbredirparser *parser_pub,
+    struct usb_redir_multi_iso_packet_header *multi_iso_packet,
+    uint8_t *data, int data_len)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    struct usb_redir_multi_iso_packet_desc *desc =
+        (struct usb_redir_multi_iso_packet_desc *)data;
+    int i, count = multi_iso_packet->packet_count;
+    uint32_t length;
+
+    if (count == 0) {
+        ERROR("error multi iso packet without packets");
+        return 0;
+    }
+    if ((uint32_t)data_len < count * sizeof(*desc)) {
+        ERROR("error multi iso packet too short for %d packets", count);
+        return 0;
+    }
+    length = count * sizeof(*desc);
+    for (i = 0; i < count; i++)
+        length += desc[i].length;
+    if (length != (uint32_t)data_len) {
+        ERROR("error multi iso packet lengths %u != data len %d",
+              length, data_len);
+        return 0;
+    }
+    return 1; /* Verify ok */
+}
+
 static int usbredirparser_verify_type_header(
     struct usbredirparser *parser_pub,
     int32_t type, void *header, uint8_t *data, int data_len, int send)
@@ -662,6 +1308,22 @@ static int usbredirparser_verify_type_header(
         }
         break;
     }
+    case usb_redir_ep_credits: {
+        struct usb_redir_ep_credits_header *ep_credits = header;
+
+        if ((send && !usbredirparser_peer_has_cap(parser_pub,
+                                             usb_redir_cap_ep_credits)) ||
+            (!send && !usbredirparser_have_cap(parser_pub,
+                                             usb_redir_cap_ep_credits))) {
+            ERROR("error ep_credits without cap_ep_credits");
+            return 0;
+        }
+        if (!(ep_credits->endpoint & 0x80)) {
+            ERROR("ep credits for non input ep %02x", ep_credits->endpoint);
+            return 0;
+        }
+        break;
+    }
     case usb_redir_control_packet:
         length = ((struct usb_redir_control_packet_header *)header)->length;
         ep = ((struct usb_redir_control_packet_header *)header)->endpoint;
@@ -708,6 +1370,28 @@ static int usbredirparser_verify_type_header(
         ep = buf_bulk_pkt->endpoint;
         break;
     }
+    case usb_redir_multi_iso_packet: {
+        struct usb_redir_multi_iso_packet_header *multi_iso_pkt = header;
+        if ((send && !usbredirparser_peer_has_cap(parser_pub,
+                                     usb_redir_cap_multi_iso_packets)) ||
+            (!send && !usbredirparser_have_cap(parser_pub,
+                                     usb_redir_cap_multi_iso_packets))) {
+            ERROR("error multi_iso_packet without cap_multi_iso_packets");
+            return 0;
+        }
+        length = multi_iso_pkt->length;
+        if ((uint32_t)length > MAX_BULK_TRANSFER_SIZE) {
+            ERROR("multi iso packet length exceeds limits %u > %u",
+                  (uint32_t)length, MAX_BULK_TRANSFER_SIZE);
+            return 0;
+        }
+        if (!usbredirparser_verify_multi_iso_data(parser_pub,
+                                           multi_iso_pkt, data, data_len)) {
+            return 0;
+        }
+        ep = multi_iso_pkt->endpoint;
+        break;
+    }
     }
 
     if (ep != -1) {
@@ -728,6 +1412,7 @@ static int usbredirparser_verify_type_header(
             }
             switch (type) {
             case usb_redir_iso_packet:
+            case usb_redir_multi_iso_packet:
                 ERROR("error iso packet send in wrong direction");
                 return 0;
             case usb_redir_interrupt_packet:
@@ -746,16 +1431,56 @@ static int usbredirparser_verify_type_header(
     return 1; /* Verify ok */
 }
 
-static void usbredirparser_call_type_func(struct usbredirparser *parser_pub)
+/* Pass the packets of a multi iso packet to iso_packet_func one by one, for
+   apps which don't handle multi iso packets themselves */
+static void usbredirparser_split_multi_iso_packet(
+    struct usbredirparser *parser_pub, uint64_t id)
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
-    uint64_t id;
+    struct usb_redir_multi_iso_packet_header *multi_iso_packet =
+        (struct usb_redir_multi_iso_packet_header *)parser->type_header;
+    struct usb_redir_multi_iso_packet_desc *desc =
+        (struct usb_redir_multi_iso_packet_desc *)parser->data;
+    struct usb_redir_iso_packet_header iso_packet;
+    int i, count = multi_iso_packet->packet_count;
+    int borrow = parser->flags & usbredirparser_fl_borrow_packet_data;
+    uint8_t *data, *pkt_data;
+
+    data = parser->data + count * sizeof(*desc);
+    for (i = 0; i < count; i++, data += iso_packet.length) {
+        iso_packet.endpoint = multi_iso_packet->endpoint;
+        iso_packet.status = desc[i].status;
+        iso_packet.length = desc[i].length;
+        pkt_data = NULL;
+        if (borrow) {
+            pkt_data = data;
+        } else if (iso_packet.length) {
+            pkt_data = usbredirparser_mem_alloc(parser, iso_packet.length,
+                                                usb_redir_iso_packet);
+            if (!pkt_data) {
+                ERROR("Out of memory, dropping iso packet");
+                continue;
+            }
+            memcpy(pkt_data, data, iso_packet.length);
+        }
+        parser->callb.iso_packet_func(parser->callb.priv, id + i,
+                                      &iso_packet, pkt_data,
+                                      iso_packet.length);
+    }
 
-    if (usbredirparser_using_32bits_ids(parser_pub))
-        id = parser->header_32bit_id.id;
-    else
-        id = parser->header.id;
+    /* The data has been passed on in copies (or is freed by our caller) */
+    if (!borrow && !parser->data_placed) {
+        usbredirparser_mem_free(parser, parser->data);
+        parser->data = NULL;
+    }
+}
+
+static void usbredirparser_call_type_func(struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    uint64_t id = usbredirparser_get_id(parser_pub);
 
     switch (parser->header.type) {
     case usb_redir_hello:
@@ -859,6 +1584,7 @@ static void usbredirparser_call_type_func(struct usbredirparser *parser_pub)
 
         r = usbredirfilter_string_to_rules((char *)parser->data, ",", "|",
                                            &rules, &count);
+        usbredirparser_mem_free(parser, parser->data);
         if (r) {
             ERROR("error parsing filter (%d), ignoring filter message", r);
             break;
@@ -884,6 +1610,11 @@ static void usbredirparser_call_type_func(struct usbredirparser *parser_pub)
             (struct usb_redir_bulk_receiving_status_header *)
             parser->type_header);
         break;
+    case usb_redir_ep_credits:
+        if (parser->callb.ep_credits_func)
+            parser->callb.ep_credits_func(parser->callb.priv, id,
+                (struct usb_redir_ep_credits_header *)parser->type_header);
+        break;
     case usb_redir_control_packet:
         parser->callb.control_packet_func(parser->callb.priv, id,
             (struct usb_redir_control_packet_header *)parser->type_header,
@@ -909,171 +1640,1470 @@ static void usbredirparser_call_type_func(struct usbredirparser *parser_pub)
           (struct usb_redir_buffered_bulk_packet_header *)parser->type_header,
           parser->data, parser->data_len);
         break;
+    case usb_redir_multi_iso_packet:
+        if (parser->callb.multi_iso_packet_func)
+            parser->callb.multi_iso_packet_func(parser->callb.priv, id,
+              (struct usb_redir_multi_iso_packet_header *)parser->type_header,
+              parser->data, parser->data_len);
+        else
+            usbredirparser_split_multi_iso_packet(parser_pub, id);
+        break;
     }
 }
 
-int usbredirparser_do_read(struct usbredirparser *parser_pub)
+/**************************************************************************/
+/* Compression support, with usb_redir_cap_compression the data of bulk and
+   buffered bulk packets may be zlib compressed, it then is shorter than the
+   data length in the packet type header. */
+
+static int usbredirparser_using_compression(struct usbredirparser *parser_pub)
 {
-    struct usbredirparser_priv *parser =
-        (struct usbredirparser_priv *)parser_pub;
-    int r, header_len, type_header_len, data_len;
-    uint8_t *dest;
+    return usbredirparser_have_cap(parser_pub, usb_redir_cap_compression) &&
+           usbredirparser_peer_has_cap(parser_pub, usb_redir_cap_compression);
+}
 
-    header_len = usbredirparser_get_header_len(parser_pub);
+/* Returns the data length from the type header of a packet which may have
+   compressed data, or -1 for other packet types */
+static int64_t usbredirparser_get_uncompressed_len(
+    struct usbredirparser *parser_pub, int32_t type, void *type_header)
+{
+    struct usb_redir_bulk_packet_header *bulk_packet = type_header;
 
-    /* Skip forward to next packet (only used in error conditions) */
-    while (parser->to_skip > 0) {
-        uint8_t buf[65536];
-        r = (parser->to_skip > sizeof(buf)) ? sizeof(buf) : parser->to_skip;
-        r = parser->callb.read_func(parser->callb.priv, buf, r);
-        if (r <= 0)
+    switch (type) {
+    case usb_redir_bulk_packet:
+        if (usbredirparser_have_cap(parser_pub,
+                                usb_redir_cap_32bits_bulk_length) &&
+            usbredirparser_peer_has_cap(parser_pub,
+                                usb_redir_cap_32bits_bulk_length))
+            return ((uint32_t)bulk_packet->length_high << 16) |
+                   bulk_packet->length;
+        return bulk_packet->length;
+    case usb_redir_buffered_bulk_packet:
+        return ((struct usb_redir_buffered_bulk_packet_header *)
+                type_header)->length;
+    default:
+        return -1;
+    }
+}
+
+/* Returns 1 if the data of the packet being read is compressed */
+static int usbredirparser_data_compressed(struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    if (!parser->data_len || !usbredirparser_using_compression(parser_pub))
+        return 0;
+
+    return parser->data_len < usbredirparser_get_uncompressed_len(parser_pub,
+                                  parser->header.type, parser->type_header);
+}
+
+/* Called once all (compressed) data of a packet has been read, replaces it
+   with the decompressed data. Returns 0 if the data is invalid. */
+static int usbredirparser_decompress(struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+#ifdef HAVE_ZLIB
+    uint32_t len = usbredirparser_get_uncompressed_len(parser_pub,
+                                   parser->header.type, parser->type_header);
+    uLongf dest_len = len;
+    uint64_t start;
+    uint8_t *data;
+    int r;
+
+    if (len > MAX_BULK_TRANSFER_SIZE) {
+        ERROR("compressed bulk packet length exceeds limits %u > %u",
+              len, MAX_BULK_TRANSFER_SIZE);
+        return 0;
+    }
+
+    data = usbredirparser_mem_alloc(parser, len, parser->header.type);
+    if (!data) {
+        ERROR("Out of memory allocating data buffer");
+        return 0;
+    }
+
+    start = usbredirparser_time();
+    r = uncompress(data, &dest_len, parser->data, parser->data_len);
+    if (r != Z_OK || dest_len != len) {
+        ERROR("error decompressing packet data: %d", r);
+        usbredirparser_mem_free(parser, data);
+        return 0;
+    }
+
+    LOCK(parser);
+    parser->compression_stats.packets_decompressed++;
+    parser->compression_stats.decompress_usec +=
+        usbredirparser_time() - start;
+    UNLOCK(parser);
+
+    if (!parser->data_borrowed)
+        usbredirparser_mem_free(parser, parser->data);
+    parser->data = data;
+    parser->data_len = len;
+    parser->data_borrowed = 0;
+    return 1;
+#else
+    ERROR("error compressed data without zlib support, please report!!");
+    return 0;
+#endif
+}
+
+/* Returns the endpoint of a packet which may have compressed data */
+static uint8_t usbredirparser_compress_ep(int32_t type, void *type_header)
+{
+    if (type == usb_redir_bulk_packet)
+        return ((struct usb_redir_bulk_packet_header *)type_header)->endpoint;
+    return ((struct usb_redir_buffered_bulk_packet_header *)
+            type_header)->endpoint;
+}
+
+/* Returns 1 if the data of a packet we're about to send should be offered
+   to usbredirparser_compress. Endpoints which have repeatedly sent
+   incompressible data get skipped for a while. */
+static int usbredirparser_may_compress(struct usbredirparser *parser_pub,
+    int32_t type, void *type_header, int data_len)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    int i, skip = 0;
+
+    if ((type != usb_redir_bulk_packet &&
+         type != usb_redir_buffered_bulk_packet) ||
+            data_len < COMPRESS_MIN_LEN ||
+            !usbredirparser_using_compression(parser_pub))
+        return 0;
+
+    i = EP_SLOT(usbredirparser_compress_ep(type, type_header));
+    COMPRESS_LOCK(parser);
+    if (parser->compress_skip[i]) {
+        parser->compress_skip[i]--;
+        skip = 1;
+    }
+    COMPRESS_UNLOCK(parser);
+
+    if (skip) {
+        LOCK(parser);
+        parser->compression_stats.packets_skipped++;
+        UNLOCK(parser);
+    }
+    return !skip;
+}
+
+/* Compress data_len bytes of packet data from data into dest, which has
+   room for data_len bytes. Returns the compressed length, or 0 if the data
+   should be send uncompressed as it does not compress to at most 15/16th
+   of its size. A single deflate stream gets reused for all packets, as
+   setting one up for each packet is a lot more expensive than resetting. */
+static int usbredirparser_compress(struct usbredirparser *parser_pub,
+    int32_t type, void *type_header,
+    uint8_t *dest, const uint8_t *data, int data_len)
+{
+#ifdef HAVE_ZLIB
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    z_stream *strm = &parser->deflate_stream;
+    uint64_t start;
+    int i, r, dest_len = 0;
+
+    i = EP_SLOT(usbredirparser_compress_ep(type, type_header));
+    start = usbredirparser_time();
+
+    COMPRESS_LOCK(parser);
+    if (!parser->deflate_initialized) {
+        r = deflateInit(strm, Z_BEST_SPEED);
+        if (r != Z_OK) {
+            COMPRESS_UNLOCK(parser);
+            ERROR("error initializing compression: %d", r);
+            return 0;
+        }
+        parser->deflate_initialized = 1;
+    } else {
+        deflateReset(strm);
+    }
+    strm->next_in = (Bytef *)data;
+    strm->avail_in = data_len;
+    strm->next_out = dest;
+    strm->avail_out = data_len - data_len / 16;
+    r = deflate(strm, Z_FINISH);
+    if (r == Z_STREAM_END) {
+        dest_len = strm->total_out;
+        parser->compress_failures[i] = 0;
+    } else if (++parser->compress_failures[i] >= COMPRESS_MAX_FAILURES) {
+        /* Keep backing off until a packet compresses again */
+        parser->compress_failures[i] = COMPRESS_MAX_FAILURES;
+        parser->compress_skip[i] = COMPRESS_BACKOFF;
+    }
+    COMPRESS_UNLOCK(parser);
+
+    LOCK(parser);
+    parser->compression_stats.compress_usec += usbredirparser_time() - start;
+    if (dest_len) {
+        parser->compression_stats.packets_compressed++;
+        parser->compression_stats.bytes_in += data_len;
+        parser->compression_stats.bytes_out += dest_len;
+    } else {
+        parser->compression_stats.packets_incompressible++;
+    }
+    UNLOCK(parser);
+
+    return dest_len;
+#else
+    return 0;
+#endif
+}
+
+void usbredirparser_get_compression_stats(struct usbredirparser *parser_pub,
+    struct usbredirparser_compression_stats *stats)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    LOCK(parser);
+    *stats = parser->compression_stats;
+    UNLOCK(parser);
+}
+
+/* Returns the amount of bytes needed to complete the current parsing stage
+   and in dest where they should be stored */
+static int usbredirparser_get_read_dest(struct usbredirparser_priv *parser,
+    int header_len, uint8_t **dest)
+{
+    if (parser->header_read < header_len) {
+        if (usbredirparser_using_compact_header(
+                                (struct usbredirparser *)parser))
+            *dest = parser->compact_header + parser->header_read;
+        else
+            *dest = (uint8_t *)&parser->header + parser->header_read;
+        return header_len - parser->header_read;
+    } else if (parser->type_header_read < parser->type_header_len) {
+        *dest = parser->type_header + parser->type_header_read;
+        return parser->type_header_len - parser->type_header_read;
+    } else {
+        *dest = parser->data + parser->data_read;
+        return parser->data_len - parser->data_read;
+    }
+}
+
+/* Called once the headers of a packet have been read, to get the buffer
+   for its data. avail is the amount of data which has been received, but
+   not yet parsed. If that includes all of the packet's data, the data
+   will be parsed before returning to the app, so the app may place it,
+   or with usbredirparser_fl_borrow_packet_data it may be passed to the app
+   without copying it out of the buffer being parsed. */
+static int usbredirparser_get_data_buf(struct usbredirparser *parser_pub,
+    int avail)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    /* Unserialize allocates the data buffer itself */
+    if (!parser->data_len || parser->data)
+        return 0;
+
+    /* Pass large bulk packets to the app in chunks, see
+       usbredirparser_bulk_packet_chunk. Since the app gets the data before
+       we have all of it, the packet gets verified up front. */
+    if (parser->header.type == usb_redir_bulk_packet &&
+            parser->callb.bulk_packet_chunk_func &&
+            parser->data_len > USBREDIRPARSER_BULK_CHUNK_SIZE &&
+            !parser->data_chunked &&
+            !usbredirparser_data_compressed(parser_pub)) {
+        if (!usbredirparser_verify_type_header(parser_pub,
+                 parser->header.type, parser->type_header,
+                 NULL, parser->data_len, 0)) {
+            parser->to_skip = parser->data_len;
+            parser->header_read = 0;
+            parser->type_header_len  = 0;
+            parser->type_header_read = 0;
+            parser->data_len = 0;
+            return usbredirparser_read_parse_error;
+        }
+        parser->data_chunked = 1;
+        parser->chunk_offset = 0;
+        parser->chunk_remain = parser->data_len -
+                               USBREDIRPARSER_BULK_CHUNK_SIZE;
+        parser->data_len = USBREDIRPARSER_BULK_CHUNK_SIZE;
+    }
+
+    if (parser->callb.place_packet_data_func &&
+            avail >= parser->data_len && !parser->data_chunked &&
+            usbredirparser_is_data_packet(parser->header.type) &&
+            !usbredirparser_data_compressed(parser_pub)) {
+        parser->data = parser->callb.place_packet_data_func(
+                           parser->callb.priv,
+                           usbredirparser_get_id(parser_pub),
+                           parser->header.type,
+                           parser->type_header, parser->data_len);
+        if (parser->data) {
+            parser->data_placed = 1;
+            return 0;
+        }
+    }
+
+    /* usbredirparser_parse_buf will point data into the buffer */
+    if ((parser->flags & usbredirparser_fl_borrow_packet_data) &&
+            avail >= parser->data_len &&
+            usbredirparser_is_data_packet(parser->header.type)) {
+        parser->data_borrowed = 1;
+        return 0;
+    }
+
+    parser->data = usbredirparser_mem_alloc(parser, parser->data_len,
+                                            parser->header.type);
+    if (!parser->data) {
+        ERROR("Out of memory allocating data buffer");
+        parser->to_skip = parser->data_len;
+        if (parser->data_chunked) {
+            /* Let the app know the packet got truncated */
+            parser->to_skip += parser->chunk_remain;
+            parser->callb.bulk_packet_chunk_func(parser->callb.priv,
+                usbredirparser_get_id(parser_pub),
+                (struct usb_redir_bulk_packet_header *)parser->type_header,
+                NULL, 0, parser->chunk_offset, 1);
+        }
+        parser->header_read = 0;
+        parser->type_header_len  = 0;
+        parser->type_header_read = 0;
+        parser->data_len = 0;
+        parser->data_chunked = 0;
+        return usbredirparser_read_parse_error;
+    }
+    return 0;
+}
+
+/* Called when a chunk of a bulk packet being passed in chunks has been
+   read, avail is as for usbredirparser_get_data_buf */
+static int usbredirparser_bulk_chunk_done(struct usbredirparser *parser_pub,
+    int avail)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    int last = (parser->chunk_remain == 0);
+
+    parser->callb.bulk_packet_chunk_func(parser->callb.priv,
+        usbredirparser_get_id(parser_pub),
+        (struct usb_redir_bulk_packet_header *)parser->type_header,
+        parser->data, parser->data_len, parser->chunk_offset, last);
+    if ((parser->flags & usbredirparser_fl_borrow_packet_data) &&
+            !parser->data_borrowed)
+        usbredirparser_mem_free(parser, parser->data);
+    parser->data = NULL;
+    parser->data_borrowed = 0;
+    parser->data_read = 0;
+
+    if (!last) {
+        parser->chunk_offset += parser->data_len;
+        if (parser->chunk_remain > USBREDIRPARSER_BULK_CHUNK_SIZE)
+            parser->data_len = USBREDIRPARSER_BULK_CHUNK_SIZE;
+        else
+            parser->data_len = parser->chunk_remain;
+        parser->chunk_remain -= parser->data_len;
+        return usbredirparser_get_data_buf(parser_pub, avail);
+    }
+
+    parser->header_read = 0;
+    parser->type_header_len  = 0;
+    parser->type_header_read = 0;
+    parser->data_len = 0;
+    parser->data_chunked = 0;
+    return 0;
+}
+
+/* Called after r bytes have been stored at the location returned by
+   usbredirparser_get_read_dest, avail is the amount of data received after
+   these r bytes which has not been parsed yet. Returns 0 or
+   usbredirparser_read_parse_error */
+static int usbredirparser_advance(struct usbredirparser *parser_pub,
+    int header_len, int r, int avail)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    int type_header_len, data_len;
+
+    if (parser->header_read < header_len) {
+        parser->header_read += r;
+        if (parser->header_read == header_len &&
+                usbredirparser_using_compact_header(parser_pub)) {
+            r = usbredirparser_decode_compact_header(parser);
+            if (r < 0) {
+                /* We've lost track of the packet boundaries */
+                ERROR("error invalid compact packet header");
+                parser->header_read = 0;
+                return usbredirparser_read_parse_error;
+            }
+            if (r == 0)
+                return 0;
+        }
+        if (parser->header_read == header_len) {
+            type_header_len =
+                usbredirparser_get_type_header_len(parser_pub,
+                                                   parser->header.type, 0);
+            if (type_header_len < 0) {
+                ERROR("error invalid usb-redir packet type: %u",
+                      parser->header.type);
+                parser->to_skip = parser->header.length;
+                parser->header_read = 0;
+                return usbredirparser_read_parse_error;
+            }
+            /* This should never happen */
+            if (type_header_len > sizeof(parser->type_header)) {
+                ERROR("error type specific header buffer too small, please report!!");
+                parser->to_skip = parser->header.length;
+                parser->header_read = 0;
+                return usbredirparser_read_parse_error;
+            }
+            if ((int)parser->header.length < type_header_len ||
+                ((int)parser->header.length > type_header_len &&
+                 !usbredirparser_expect_extra_data(parser))) {
+                ERROR("error invalid packet type %u length: %u",
+                      parser->header.type, parser->header.length);
+                parser->to_skip = parser->header.length;
+                parser->header_read = 0;
+                return usbredirparser_read_parse_error;
+            }
+            data_len = parser->header.length - type_header_len;
+            parser->type_header_len = type_header_len;
+            parser->data_len = data_len;
+            if (type_header_len == 0) {
+                usbredirparser_resolve_id(parser_pub);
+                return usbredirparser_get_data_buf(parser_pub, avail);
+            }
+        }
+    } else if (parser->type_header_read < parser->type_header_len) {
+        parser->type_header_read += r;
+        if (parser->type_header_read == parser->type_header_len) {
+            usbredirparser_resolve_id(parser_pub);
+            return usbredirparser_get_data_buf(parser_pub, avail);
+        }
+    } else {
+        parser->data_read += r;
+        if (parser->data_read == parser->data_len && parser->data_chunked)
+            return usbredirparser_bulk_chunk_done(parser_pub, avail);
+        if (parser->data_read == parser->data_len) {
+            r = !usbredirparser_data_compressed(parser_pub) ||
+                usbredirparser_decompress(parser_pub);
+            if (r)
+                r = usbredirparser_verify_type_header(parser_pub,
+                         parser->header.type, parser->type_header,
+                         parser->data, parser->data_len, 0);
+            if (r)
+                usbredirparser_call_type_func(parser_pub);
+            /* With usbredirparser_fl_borrow_packet_data the data of data
+               packets stays ours, unless taken by the app (which sets
+               parser->data to NULL) */
+            if ((!r || ((parser->flags &
+                         usbredirparser_fl_borrow_packet_data) &&
+                        usbredirparser_is_data_packet(parser->header.type)))
+                    && !parser->data_placed && !parser->data_borrowed)
+                usbredirparser_mem_free(parser, parser->data);
+            parser->header_read = 0;
+            parser->type_header_len  = 0;
+            parser->type_header_read = 0;
+            parser->data_len  = 0;
+            parser->data_read = 0;
+            parser->data = NULL;
+            parser->data_placed = 0;
+            parser->data_borrowed = 0;
+            if (!r)
+                return usbredirparser_read_parse_error;
+        }
+    }
+    return 0;
+}
+
+/* Parse (up to) len bytes from buf, stores the amount of bytes consumed in
+   consumed. This consumes all of buf unless a parse error happens. */
+static int usbredirparser_parse_buf(struct usbredirparser *parser_pub,
+    const uint8_t *buf, int len, int *consumed)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    int r, header_len, pos = 0;
+    uint8_t *dest;
+
+    while (1) {
+        /* Skip forward to next packet (only used in error conditions) */
+        if (parser->to_skip > 0) {
+            r = (parser->to_skip > len - pos) ? len - pos : parser->to_skip;
+            parser->to_skip -= r;
+            pos += r;
+            if (pos == len)
+                break;
+        }
+
+        /* header len may change if the last packet was an hello packet */
+        header_len = usbredirparser_get_read_header_len(parser_pub);
+        if (parser->data_borrowed && !parser->data) {
+            /* See usbredirparser_get_data_buf, the data is all in buf */
+            parser->data = (uint8_t *)buf + pos;
+            r = parser->data_len;
+            pos += r;
+        } else {
+            r = usbredirparser_get_read_dest(parser, header_len, &dest);
+            if (r > 0) {
+                if (pos == len)
+                    break;
+                if (r > len - pos)
+                    r = len - pos;
+                memcpy(dest, buf + pos, r);
+                pos += r;
+            }
+        }
+
+        r = usbredirparser_advance(parser_pub, header_len, r, len - pos);
+        if (r) {
+            *consumed = pos;
             return r;
-        parser->to_skip -= r;
+        }
     }
+    *consumed = pos;
+    return 0;
+}
+
+int usbredirparser_do_read(struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    int r, consumed, header_len;
+    uint8_t *dest;
+
+    /* The receive buffer is allocated on first use, if this fails we
+       simply read directly into the parsing destination buffers */
+    if (!parser->read_buf)
+        parser->read_buf = usbredirparser_mem_alloc(parser, READ_BUF_SIZE,
+                                                    -1);
 
     /* Consume data until read would block or returns an error */
     while (1) {
-        if (parser->header_read < header_len) {
-            r = header_len - parser->header_read;
-            dest = (uint8_t *)&parser->header + parser->header_read;
-        } else if (parser->type_header_read < parser->type_header_len) {
-            r = parser->type_header_len - parser->type_header_read;
-            dest = parser->type_header + parser->type_header_read;
+        /* Parse what we've already got buffered first */
+        if (parser->read_buf_pos < parser->read_buf_len) {
+            r = usbredirparser_parse_buf(parser_pub,
+                                    parser->read_buf + parser->read_buf_pos,
+                                    parser->read_buf_len - parser->read_buf_pos,
+                                    &consumed);
+            parser->read_buf_pos += consumed;
+            if (r)
+                return r;
+        }
+
+        header_len = usbredirparser_get_read_header_len(parser_pub);
+        r = usbredirparser_get_read_dest(parser, header_len, &dest);
+        if (parser->to_skip == 0 && (!parser->read_buf || r >= READ_BUF_SIZE)) {
+            /* Large payloads get read into their destination directly,
+               a packet with nothing left to read just needs advancing */
+            if (r > 0) {
+                r = parser->callb.read_func(parser->callb.priv, dest, r);
+                if (r <= 0)
+                    return r;
+            }
+            r = usbredirparser_advance(parser_pub, header_len, r, 0);
+            if (r)
+                return r;
+        } else if (parser->read_buf) {
+            /* Get as much data as the transport has available */
+            r = parser->callb.read_func(parser->callb.priv,
+                                        parser->read_buf, READ_BUF_SIZE);
+            if (r <= 0)
+                return r;
+            parser->read_buf_pos = 0;
+            parser->read_buf_len = r;
         } else {
-            r = parser->data_len - parser->data_read;
-            dest = parser->data + parser->data_read;
+            uint8_t buf[65536];
+
+            r = (parser->to_skip > sizeof(buf)) ? sizeof(buf) : parser->to_skip;
+            r = parser->callb.read_func(parser->callb.priv, buf, r);
+            if (r <= 0)
+                return r;
+            parser->to_skip -= r;
         }
+    }
+}
+
+int usbredirparser_feed(struct usbredirparser *parser_pub,
+    const uint8_t *buf, size_t len, size_t *consumed)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    int r, n, parsed;
+
+    *consumed = 0;
+
+    /* Data received through do_read, or restored by unserialize, goes first */
+    if (parser->read_buf_pos < parser->read_buf_len) {
+        r = usbredirparser_parse_buf(parser_pub,
+                                    parser->read_buf + parser->read_buf_pos,
+                                    parser->read_buf_len - parser->read_buf_pos,
+                                    &parsed);
+        parser->read_buf_pos += parsed;
+        if (r)
+            return r;
+    }
+
+    /* usbredirparser_parse_buf takes an int length */
+    while (*consumed < len) {
+        n = (len - *consumed > INT_MAX) ? INT_MAX : len - *consumed;
+        r = usbredirparser_parse_buf(parser_pub, buf + *consumed, n, &parsed);
+        *consumed += parsed;
+        if (r)
+            return r;
+    }
+    return 0;
+}
+
+int usbredirparser_has_data_to_write(struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    return parser->write_queue.count + parser->slot_queued;
+}
+
+/* Returns a pointer to a new entry at the end of the write queue q, or NULL
+   when out of memory. Note caller must hold the parser lock */
+static struct usbredirparser_buf *usbredirparser_wqueue_push(
+    struct usbredirparser_priv *parser, struct usbredirparser_wqueue *q)
+{
+    struct usbredirparser_buf *buf;
+    int size, wrapped;
+
+    if (q->count == q->size) {
+        size = q->size ? q->size * 2 : 64;
+        buf = usbredirparser_mem_realloc(parser, q->buf, size * sizeof(*buf),
+                                         -1);
+        if (!buf)
+            return NULL;
+        /* Move the wrapped around start of the ring to after its old end */
+        wrapped = q->head + q->count - q->size;
+        if (wrapped > 0)
+            memcpy(buf + q->size, buf, wrapped * sizeof(*buf));
+        q->buf = buf;
+        q->size = size;
+    }
+    return WQBUF(q, q->count++);
+}
+
+/* Note caller must hold the parser lock */
+static void usbredirparser_wqueue_pop(struct usbredirparser_wqueue *q)
+{
+    q->head = (q->head + 1) & (q->size - 1);
+    q->count--;
+}
+
+/* Queue a packet for writing at the end of the queue of its id slot, or for
+   packets from usbredirparser_unserialize (slot -1) directly at the end of
+   the write queue. ep_type is the endpoint type whose ttl applies to the
+   packet, or -1 if the packet does not expire.
+   Note caller must hold the parser lock */
+static int usbredirparser_write_buf_append(struct usbredirparser_priv *parser,
+    uint8_t *buf, int pos, int len, int type, int slot, int ep_type)
+{
+    struct usbredirparser_buf *write_buf;
+
+    if (slot == -1) {
+        write_buf = usbredirparser_wqueue_push(parser, &parser->write_queue);
+    } else {
+        write_buf = usbredirparser_wqueue_push(parser,
+                                               &parser->slot_queue[slot]);
+        if (write_buf)
+            parser->slot_queued++;
+    }
+    if (!write_buf)
+        return -1;
+
+    write_buf->buf = buf;
+    write_buf->pos = pos;
+    write_buf->len = len;
+    write_buf->time = usbredirparser_time();
+    write_buf->seq = parser->write_seq++;
+    write_buf->expires = 0;
+    write_buf->started = 0;
+    write_buf->writing = 0;
+    write_buf->ep_type = ep_type;
+    write_buf->type = type;
+    write_buf->slot = slot;
+    if (ep_type != -1 && parser->packet_ttl[ep_type])
+        write_buf->expires = write_buf->time + parser->packet_ttl[ep_type];
+    parser->write_buf_bytes += len - pos;
+    return 0;
+}
+
+/* Returns the seq of the packet at the head of a slot queue, or UINT64_MAX
+   if the queue is empty. Note caller must hold the parser lock */
+static uint64_t usbredirparser_head_seq(struct usbredirparser_priv *parser,
+    int slot)
+{
+    struct usbredirparser_wqueue *q = &parser->slot_queue[slot];
+
+    return q->count ? WQBUF(q, 0)->seq : UINT64_MAX;
+}
+
+/* Pick the slot queue from which to write the next packet. Packets within a
+   slot are always written in order. Packets which are not tied to an
+   endpoint (device_connect, ep_info, ...) are barriers, they are written
+   once all packets queued before them have been, and packets queued after
+   them wait for them. Before the barrier, slots with a control or status
+   packet at their head go first, oldest packet first. Otherwise the slots
+   take turns using deficit round robin, each sending up to its weight times
+   WRITE_QUANTUM bytes per turn.
+   Note caller must hold the parser lock, and make sure slot_queued != 0 */
+static int usbredirparser_next_write_slot(struct usbredirparser_priv *parser)
+{
+    struct usbredirparser_buf *wbuf;
+    int i, len, slot = -1, before_barrier = 0;
+    uint64_t seq, barrier, oldest = 0;
+
+    barrier = usbredirparser_head_seq(parser, NO_EP_SLOT);
+    for (i = 0; i < NO_EP_SLOT; i++) {
+        seq = usbredirparser_head_seq(parser, i);
+        if (seq >= barrier)
+            continue;
+        before_barrier = 1;
+        wbuf = WQBUF(&parser->slot_queue[i], 0);
+        if ((wbuf->type == usb_redir_control_packet ||
+             !usbredirparser_is_data_packet(wbuf->type)) &&
+                (slot == -1 || seq < oldest)) {
+            slot = i;
+            oldest = seq;
+        }
+    }
+    if (slot != -1)
+        return slot;
+    if (!before_barrier)
+        return NO_EP_SLOT;
+
+    /* Only slots whose head is before the barrier get a turn */
+    for (;;) {
+        slot = parser->write_rr_slot;
+        if (usbredirparser_head_seq(parser, slot) < barrier) {
+            wbuf = WQBUF(&parser->slot_queue[slot], 0);
+            len = wbuf->len - wbuf->pos;
+            if (parser->write_deficit[slot] >= len) {
+                parser->write_deficit[slot] -= len;
+                return slot;
+            }
+        } else if (!parser->slot_queue[slot].count) {
+            parser->write_deficit[slot] = 0;
+        }
+        /* Start the turn of the next slot */
+        slot = (slot + 1) % COMPACT_ID_SLOTS;
+        parser->write_rr_slot = slot;
+        if (usbredirparser_head_seq(parser, slot) < barrier)
+            parser->write_deficit[slot] += (int64_t)WRITE_QUANTUM *
+                (parser->write_weight[slot] ? parser->write_weight[slot] : 1);
+    }
+}
+
+/* Move packets from the slot queues to the write queue until it holds max
+   packets or WRITE_STAGE_BYTES bytes. Returns the number of packets moved.
+   Note caller must hold the parser lock */
+static int usbredirparser_stage_packets(struct usbredirparser_priv *parser,
+    int max)
+{
+    struct usbredirparser_wqueue *q;
+    struct usbredirparser_buf *wbuf;
+    int i, slot, staged = 0, bytes = 0;
+
+    for (i = 0; i < parser->write_queue.count; i++) {
+        wbuf = WBUF(parser, i);
+        bytes += wbuf->len - wbuf->pos;
+    }
+
+    while (parser->slot_queued && parser->write_queue.count < max &&
+           bytes < WRITE_STAGE_BYTES) {
+        /* Grow the write queue first, so that the packet has a place to go
+           once its slot has been picked */
+        wbuf = usbredirparser_wqueue_push(parser, &parser->write_queue);
+        if (!wbuf)
+            break;
+        slot = usbredirparser_next_write_slot(parser);
+        q = &parser->slot_queue[slot];
+        *wbuf = *WQBUF(q, 0);
+        usbredirparser_wqueue_pop(q);
+        parser->slot_queued--;
+        bytes += wbuf->len - wbuf->pos;
+        staged++;
+    }
+    return staged;
+}
+
+/* Note caller must hold the parser lock. Returns 1 if the amount of queued
+   bytes has risen to the high watermark, 0 if it has dropped to the low
+   watermark and -1 otherwise. */
+static int usbredirparser_check_watermarks(struct usbredirparser_priv *parser)
+{
+    if (!parser->write_high_watermark)
+        return -1;
+
+    if (!parser->write_above_high_watermark &&
+            parser->write_buf_bytes >= parser->write_high_watermark) {
+        parser->write_above_high_watermark = 1;
+        return 1;
+    }
+    if (parser->write_above_high_watermark &&
+            parser->write_buf_bytes <= parser->write_low_watermark) {
+        parser->write_above_high_watermark = 0;
+        return 0;
+    }
+    return -1;
+}
+
+/* Report watermark crossings to the app, high is the result of
+   usbredirparser_check_watermarks. The callback gets called with the lock
+   dropped, so rather than passing on high, which may be stale by then, this
+   reports the current state, and only one thread at a time does so. A thread
+   finding another thread already calling the callback leaves reporting the
+   new state to that thread, which keeps calling it until the reported state
+   matches the current one. This way the app always sees alternating high /
+   low calls, ending with the current state. */
+static void usbredirparser_call_watermark_func(
+    struct usbredirparser_priv *parser, int high)
+{
+    if (high == -1 || !parser->callb.write_watermark_func)
+        return;
+
+    LOCK(parser);
+    if (parser->write_watermark_calling) {
+        UNLOCK(parser);
+        return;
+    }
+    parser->write_watermark_calling = 1;
+    while (parser->write_watermark_reported !=
+               parser->write_above_high_watermark) {
+        high = parser->write_above_high_watermark;
+        parser->write_watermark_reported = high;
+        UNLOCK(parser);
+        parser->callb.write_watermark_func(parser->callb.priv, high);
+        LOCK(parser);
+    }
+    parser->write_watermark_calling = 0;
+    UNLOCK(parser);
+}
+
+/* Decode the compact header of a queued packet, returns its length */
+static int usbredirparser_get_queued_compact_header(const uint8_t *buf,
+    uint64_t *vals)
+{
+    int i, shift, pos = 0;
+
+    for (i = 0; i < 3; i++) {
+        vals[i] = 0;
+        shift = 0;
+        do {
+            vals[i] |= (uint64_t)(buf[pos] & 0x7f) << shift;
+            shift += 7;
+        } while (buf[pos++] & 0x80);
+    }
+    return pos;
+}
+
+/* Returns the zigzag decoded id delta of a queued packet with a compact
+   header, storing its header fields in vals and its length in *header_len */
+static uint64_t usbredirparser_get_queued_id_delta(
+    struct usbredirparser_buf *wbuf, uint64_t *vals, int *header_len)
+{
+    *header_len = usbredirparser_get_queued_compact_header(
+                                                wbuf->buf + wbuf->pos, vals);
+    return (vals[2] >> 1) ^ -(vals[2] & 1);
+}
+
+/* Re-encode the compact header of a queued packet with a new id delta,
+   vals and header_len are its current header fields and length.
+   Returns 0 on success, -1 when out of memory.
+   Note caller must hold the parser lock */
+static int usbredirparser_compact_set_delta(struct usbredirparser_priv *parser,
+    struct usbredirparser_buf *wbuf, uint64_t *vals, int header_len,
+    uint64_t delta)
+{
+    uint8_t header[COMPACT_HEADER_MAX_LEN], *buf;
+    int len, data_len;
+
+    len = usbredirparser_put_varint(header, vals[0]);
+    len += usbredirparser_put_varint(header + len, vals[1]);
+    len += usbredirparser_put_varint(header + len,
+                                     (delta << 1) ^ -(delta >> 63));
+    data_len = wbuf->len - wbuf->pos - header_len;
+
+    /* With fl_write_cb_owns_buffer packets must start at the start of
+       their buffer, otherwise try to fit the new header in place */
+    if (!(parser->flags & usbredirparser_fl_write_cb_owns_buffer) &&
+            len <= wbuf->pos + header_len) {
+        wbuf->pos += header_len - len;
+        memcpy(wbuf->buf + wbuf->pos, header, len);
+    } else {
+        buf = usbredirparser_mem_alloc(parser, len + data_len, -1);
+        if (!buf)
+            return -1;
+        memcpy(buf, header, len);
+        memcpy(buf + len, wbuf->buf + wbuf->pos + header_len, data_len);
+        usbredirparser_mem_free(parser, wbuf->buf);
+        wbuf->buf = buf;
+        wbuf->pos = 0;
+        wbuf->len = len + data_len;
+    }
+    parser->write_buf_bytes += len - header_len;
+    return 0;
+}
+
+/* When using compact headers the id delta of a queued packet is relative to
+   the packet queued before it with the same id slot. Before dropping the
+   packet at index i of write queue q, make the delta of the next packet with
+   the same slot relative to the packet before the dropped one.
+   Returns 0 on success, -1 when out of memory.
+   Note caller must hold the parser lock */
+static int usbredirparser_compact_unlink(struct usbredirparser_priv *parser,
+    struct usbredirparser_wqueue *q, int i)
+{
+    struct usbredirparser_buf *wbuf = WQBUF(q, i);
+    uint64_t vals[3], delta;
+    int slot = wbuf->slot, header_len;
+
+    if (slot == -1)
+        return -1;
+
+    delta = usbredirparser_get_queued_id_delta(wbuf, vals, &header_len);
+    /* The next packet is either further down the same queue, or when
+       dropping from the write queue, at the head of the slot queue */
+    for (i++; i < q->count; i++) {
+        if (WQBUF(q, i)->slot == slot)
+            break;
+    }
+    if (i < q->count) {
+        wbuf = WQBUF(q, i);
+    } else if (q == &parser->write_queue &&
+               parser->slot_queue[slot].count) {
+        wbuf = WQBUF(&parser->slot_queue[slot], 0);
+    } else {
+        parser->send_ids[slot] -= delta;
+        return 0;
+    }
+    delta += usbredirparser_get_queued_id_delta(wbuf, vals, &header_len);
+    return usbredirparser_compact_set_delta(parser, wbuf, vals, header_len,
+                                            delta);
+}
+
+/* Returns 1 if the packet at index i in the write queue has expired */
+static int usbredirparser_write_buf_expired(
+    struct usbredirparser_priv *parser, int i, uint64_t now)
+{
+    struct usbredirparser_buf *wbuf = WBUF(parser, i);
+
+    return !wbuf->started && wbuf->expires && wbuf->expires <= now;
+}
+
+/* Drop packets at the head of the write queue whose time to live has
+   expired. Note caller must hold the parser lock */
+static void usbredirparser_expire_packets(struct usbredirparser_priv *parser)
+{
+    struct usbredirparser *parser_pub = (struct usbredirparser *)parser;
+    struct usbredirparser_buf *wbuf;
+    uint64_t now;
+
+    if (!parser->write_queue.count || !WBUF(parser, 0)->expires)
+        return;
+
+    now = usbredirparser_time();
+    while (parser->write_queue.count &&
+           usbredirparser_write_buf_expired(parser, 0, now)) {
+        wbuf = WBUF(parser, 0);
+        if (usbredirparser_using_compact_header(parser_pub) &&
+                usbredirparser_compact_unlink(parser, &parser->write_queue,
+                                              0)) {
+            /* Send it after all rather then breaking the id deltas */
+            wbuf->expires = 0;
+            return;
+        }
+        parser->expired_packets[wbuf->ep_type]++;
+        parser->write_buf_bytes -= wbuf->len - wbuf->pos;
+        usbredirparser_mem_free(parser, wbuf->buf);
+        usbredirparser_wqueue_pop(&parser->write_queue);
+    }
+}
+
+/* Drop the not yet (partially) written packets of packet type type from
+   write queue q, whose id slot is slot. Returns the number of packets
+   dropped. Note caller must hold the parser lock */
+static int usbredirparser_purge_wqueue(struct usbredirparser_priv *parser,
+    struct usbredirparser_wqueue *q, int type, int slot)
+{
+    struct usbredirparser *parser_pub = (struct usbredirparser *)parser;
+    struct usbredirparser_buf *wbuf;
+    int i, j, purged = 0;
+
+    for (i = 0, j = 0; i < q->count; i++) {
+        wbuf = WQBUF(q, i);
+        if (!wbuf->started && !wbuf->writing && wbuf->type == type &&
+                wbuf->slot == slot &&
+                !(usbredirparser_using_compact_header(parser_pub) &&
+                  usbredirparser_compact_unlink(parser, q, i))) {
+            parser->write_buf_bytes -= wbuf->len - wbuf->pos;
+            usbredirparser_mem_free(parser, wbuf->buf);
+            purged++;
+            continue;
+        }
+        if (i != j)
+            *WQBUF(q, j) = *wbuf;
+        j++;
+    }
+    q->count = j;
+    return purged;
+}
+
+int usbredirparser_purge_write_queue(struct usbredirparser *parser_pub,
+    int type, uint8_t ep)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    int n, slot = EP_SLOT(ep), watermark = -1, purged;
+
+    switch (type) {
+    case usb_redir_iso_packet:
+    case usb_redir_multi_iso_packet:
+    case usb_redir_interrupt_packet:
+    case usb_redir_buffered_bulk_packet:
+        break;
+    default:
+        ERROR("error purge of packet type %d from write queue", type);
+        return 0;
+    }
+
+    LOCK(parser);
+    /* The write queue first, as its packets come first within the slot */
+    purged = usbredirparser_purge_wqueue(parser, &parser->write_queue, type,
+                                         slot);
+    n = usbredirparser_purge_wqueue(parser, &parser->slot_queue[slot], type,
+                                    slot);
+    parser->slot_queued -= n;
+    purged += n;
+    if (purged)
+        watermark = usbredirparser_check_watermarks(parser);
+    UNLOCK(parser);
+    usbredirparser_call_watermark_func(parser, watermark);
+
+    return purged;
+}
+
+/* Note caller must hold the parser lock */
+static void usbredirparser_write_done(struct usbredirparser_priv *parser)
+{
+    struct usbredirparser_buf *wbuf = WBUF(parser, 0);
+
+    if (!(parser->flags & usbredirparser_fl_write_cb_owns_buffer))
+        usbredirparser_mem_free(parser, wbuf->buf);
+    usbredirparser_wqueue_pop(&parser->write_queue);
+}
+
+/* Call the write callback with the lock dropped, so that senders can keep
+   queueing packets meanwhile, the packets passed to it must be marked as
+   writing so that they stay in place. The write lock keeps other writers
+   out. Note caller must hold the write lock and the parser lock */
+static int usbredirparser_call_write_func(struct usbredirparser_priv *parser,
+    const struct usbredirparser_iovec *iov, int iovcnt)
+{
+    int i, w;
+
+    UNLOCK(parser);
+    if (parser->callb.writev_func)
+        w = parser->callb.writev_func(parser->callb.priv, iov, iovcnt);
+    else
+        w = parser->callb.write_func(parser->callb.priv, iov[0].iov_base,
+                                     iov[0].iov_len);
+    LOCK(parser);
+
+    for (i = 0; i < iovcnt; i++)
+        WBUF(parser, i)->writing = 0;
+    return w;
+}
+
+static int usbredirparser_do_writev(struct usbredirparser_priv *parser)
+{
+    struct usbredirparser_iovec iov[WRITEV_MAX_IOV];
+    struct usbredirparser_buf *wbuf;
+    int i, r, w, staged, ret = 0, watermark = -1;
+    uint64_t now;
+
+    WRITE_LOCK(parser);
+    LOCK(parser);
+    for (;;) {
+        staged = usbredirparser_stage_packets(parser, WRITEV_MAX_IOV);
+        usbredirparser_expire_packets(parser);
+        r = usbredirparser_check_watermarks(parser);
+        if (r != -1)
+            watermark = r;
+        now = usbredirparser_time();
+        for (i = 0; i < WRITEV_MAX_IOV && i < parser->write_queue.count; i++) {
+            /* Leave expired packets for the next round, as the head */
+            if (i && usbredirparser_write_buf_expired(parser, i, now))
+                break;
+            wbuf = WBUF(parser, i);
+            iov[i].iov_base = wbuf->buf + wbuf->pos;
+            iov[i].iov_len = wbuf->len - wbuf->pos;
+            wbuf->writing = 1;
+        }
+        if (i == 0) {
+            /* All staged packets expired, try the next ones */
+            if (staged && parser->slot_queued)
+                continue;
+            break;
+        }
+
+        w = usbredirparser_call_write_func(parser, iov, i);
+        if (w <= 0) {
+            ret = w;
+            break;
+        }
+
+        parser->write_buf_bytes -= w;
+        if (usbredirparser_check_watermarks(parser) == 0)
+            watermark = 0;
+
+        while (w > 0 && parser->write_queue.count) {
+            wbuf = WBUF(parser, 0);
+            if (w < wbuf->len - wbuf->pos) {
+                /* See usbredirparser_writev documentation */
+                if (parser->flags & usbredirparser_fl_write_cb_owns_buffer)
+                    abort();
+                wbuf->pos += w;
+                wbuf->started = 1;
+                break;
+            }
+            w -= wbuf->len - wbuf->pos;
+            usbredirparser_write_done(parser);
+        }
+    }
+    UNLOCK(parser);
+    WRITE_UNLOCK(parser);
+    usbredirparser_call_watermark_func(parser, watermark);
+    return ret;
+}
+
+int usbredirparser_do_write(struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    struct usbredirparser_buf* wbuf;
+    struct usbredirparser_iovec iov;
+    int r, w, staged, batched, ret = 0, watermark = -1;
+
+    LOCK(parser);
+    batched = parser->batch_depth > 0;
+    UNLOCK(parser);
+    if (batched)
+        return 0;
+
+    if (parser->callb.writev_func)
+        return usbredirparser_do_writev(parser);
+
+    WRITE_LOCK(parser);
+    LOCK(parser);
+    for (;;) {    
+        /* Stage one packet at a time, so that control and status packets
+           queued while writing go out next */
+        staged = 0;
+        if (!parser->write_queue.count)
+            staged = usbredirparser_stage_packets(parser, 1);
+        usbredirparser_expire_packets(parser);
+        r = usbredirparser_check_watermarks(parser);
+        if (r != -1)
+            watermark = r;
+        if (!parser->write_queue.count) {
+            /* The staged packet expired, try the next one */
+            if (staged && parser->slot_queued)
+                continue;
+            break;
+        }
+        wbuf = WBUF(parser, 0);
+        iov.iov_base = wbuf->buf + wbuf->pos;
+        iov.iov_len = wbuf->len - wbuf->pos;
+        wbuf->writing = 1;
+
+        w = usbredirparser_call_write_func(parser, &iov, 1);
+        if (w <= 0) {
+            ret = w;
+            break;
+        }
+        wbuf = WBUF(parser, 0);
+
+        /* See usbredirparser_write documentation */
+        if ((parser->flags & usbredirparser_fl_write_cb_owns_buffer) &&
+                w != wbuf->len)
+            abort();
+
+        wbuf->pos += w;
+        wbuf->started = 1;
+        parser->write_buf_bytes -= w;
+        if (usbredirparser_check_watermarks(parser) == 0)
+            watermark = 0;
+        if (wbuf->pos == wbuf->len)
+            usbredirparser_write_done(parser);
+    }
+    UNLOCK(parser);
+    WRITE_UNLOCK(parser);
+    usbredirparser_call_watermark_func(parser, watermark);
+    return ret;
+}
+
+void usbredirparser_begin_batch(struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    LOCK(parser);
+    parser->batch_depth++;
+    UNLOCK(parser);
+}
+
+void usbredirparser_end_batch(struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    LOCK(parser);
+    if (parser->batch_depth)
+        parser->batch_depth--;
+    else
+        ERROR("error usbredirparser_end_batch called without a batch");
+    UNLOCK(parser);
+}
+
+uint64_t usbredirparser_get_write_buf_bytes(struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    uint64_t bytes;
+
+    LOCK(parser);
+    bytes = parser->write_buf_bytes;
+    UNLOCK(parser);
+    return bytes;
+}
+
+uint64_t usbredirparser_get_write_buf_age(struct usbredirparser *parser_pub)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    struct usbredirparser_wqueue *q;
+    uint64_t oldest = 0, age = 0;
+    int i;
+
+    LOCK(parser);
+    if (parser->write_queue.count)
+        oldest = WBUF(parser, 0)->time;
+    for (i = 0; i < COMPACT_ID_SLOTS; i++) {
+        q = &parser->slot_queue[i];
+        if (q->count && (!oldest || WQBUF(q, 0)->time < oldest))
+            oldest = WQBUF(q, 0)->time;
+    }
+    if (oldest)
+        age = usbredirparser_time() - oldest;
+    UNLOCK(parser);
+    return age;
+}
 
-        if (r > 0) {
-            r = parser->callb.read_func(parser->callb.priv, dest, r);
-            if (r <= 0) {
-                return r;
-            }
-        }
+void usbredirparser_set_write_watermarks(struct usbredirparser *parser_pub,
+    uint64_t high, uint64_t low)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
 
-        if (parser->header_read < header_len) {
-            parser->header_read += r;
-            if (parser->header_read == header_len) {
-                type_header_len =
-                    usbredirparser_get_type_header_len(parser_pub,
-                                                       parser->header.type, 0);
-                if (type_header_len < 0) {
-                    ERROR("error invalid usb-redir packet type: %u",
-                          parser->header.type);
-                    parser->to_skip = parser->header.length;
-                    parser->header_read = 0;
-                    return -2;
-                }
-                /* This should never happen */
-                if (type_header_len > sizeof(parser->type_header)) {
-                    ERROR("error type specific header buffer too small, please report!!");
-                    parser->to_skip = parser->header.length;
-                    parser->header_read = 0;
-                    return -2;
-                }
-                if ((int)parser->header.length < type_header_len ||
-                    ((int)parser->header.length > type_header_len &&
-                     !usbredirparser_expect_extra_data(parser))) {
-                    ERROR("error invalid packet type %u length: %u",
-                          parser->header.type, parser->header.length);
-                    parser->to_skip = parser->header.length;
-                    parser->header_read = 0;
-                    return -2;
-                }
-                data_len = parser->header.length - type_header_len;
-                if (data_len) {
-                    parser->data = malloc(data_len);
-                    if (!parser->data) {
-                        ERROR("Out of memory allocating data buffer");
-                        parser->to_skip = parser->header.length;
-                        parser->header_read = 0;
-                        return -2;
-                    }
-                }
-                parser->type_header_len = type_header_len;
-                parser->data_len = data_len;
-            }
-        } else if (parser->type_header_read < parser->type_header_len) {
-            parser->type_header_read += r;
-        } else {
-            parser->data_read += r;
-            if (parser->data_read == parser->data_len) {
-                r = usbredirparser_verify_type_header(parser_pub,
-                         parser->header.type, parser->type_header,
-                         parser->data, parser->data_len, 0);
-                if (r)
-                    usbredirparser_call_type_func(parser_pub);
-                parser->header_read = 0;
-                parser->type_header_len  = 0;
-                parser->type_header_read = 0;
-                parser->data_len  = 0;
-                parser->data_read = 0;
-                parser->data = NULL;
-                if (!r)
-                    return -2;
-                /* header len may change if this was an hello packet */
-                header_len = usbredirparser_get_header_len(parser_pub);
-            }
-        }
-    }
+    LOCK(parser);
+    parser->write_high_watermark = high;
+    parser->write_low_watermark = low;
+    parser->write_above_high_watermark = 0;
+    parser->write_watermark_reported = 0;
+    UNLOCK(parser);
 }
 
-int usbredirparser_has_data_to_write(struct usbredirparser *parser_pub)
+void usbredirparser_set_packet_ttl(struct usbredirparser *parser_pub,
+    int ep_type, uint32_t ttl)
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
-    return parser->write_buf_count;
+
+    if (ep_type != usb_redir_type_iso && ep_type != usb_redir_type_interrupt) {
+        ERROR("error packet ttl for invalid endpoint type %d", ep_type);
+        return;
+    }
+
+    LOCK(parser);
+    parser->packet_ttl[ep_type] = ttl;
+    UNLOCK(parser);
 }
 
-int usbredirparser_do_write(struct usbredirparser *parser_pub)
+void usbredirparser_set_write_weight(struct usbredirparser *parser_pub,
+    uint8_t ep, int weight)
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
-    struct usbredirparser_buf* wbuf;
-    int w, ret = 0;
+
+    if (weight < 1 || weight > MAX_WRITE_WEIGHT) {
+        ERROR("error invalid write weight %d for ep %02X", weight, ep);
+        return;
+    }
 
     LOCK(parser);
-    for (;;) {    
-        wbuf = parser->write_buf;
-        if (!wbuf)
-            break;
+    parser->write_weight[EP_SLOT(ep)] = weight;
+    UNLOCK(parser);
+}
 
-        w = wbuf->len - wbuf->pos;
-        w = parser->callb.write_func(parser->callb.priv,
-                                     wbuf->buf + wbuf->pos, w);
-        if (w <= 0) {
-            ret = w;
-            break;
-        }
+uint64_t usbredirparser_get_expired_packets(struct usbredirparser *parser_pub,
+    int ep_type)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    uint64_t expired;
 
-        /* See usbredirparser_write documentation */
-        if ((parser->flags & usbredirparser_fl_write_cb_owns_buffer) &&
-                w != wbuf->len)
-            abort();
+    if (ep_type < 0 || ep_type > 3)
+        return 0;
 
-        wbuf->pos += w;
-        if (wbuf->pos == wbuf->len) {
-            parser->write_buf = wbuf->next;
-            if (!(parser->flags & usbredirparser_fl_write_cb_owns_buffer))
-                free(wbuf->buf);
-            free(wbuf);
-            parser->write_buf_count--;
-        }
-    }
+    LOCK(parser);
+    expired = parser->expired_packets[ep_type];
     UNLOCK(parser);
-    return ret;
+    return expired;
 }
 
-void usbredirparser_free_write_buffer(struct usbredirparser *parser,
+void usbredirparser_free_write_buffer(struct usbredirparser *parser_pub,
     uint8_t *data)
 {
-    free(data);
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    usbredirparser_mem_free(parser, data);
 }
 
-void usbredirparser_free_packet_data(struct usbredirparser *parser,
+void usbredirparser_free_packet_data(struct usbredirparser *parser_pub,
     uint8_t *data)
 {
-    free(data);
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    usbredirparser_mem_free(parser, data);
+}
+
+uint8_t *usbredirparser_alloc_packet_data(struct usbredirparser *parser_pub,
+    int type, int len)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    return usbredirparser_mem_alloc(parser, len, type);
+}
+
+uint8_t *usbredirparser_alloc_packet_buffer(
+    struct usbredirparser *parser_pub, int type, int data_len)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    uint8_t *buf;
+
+    buf = usbredirparser_mem_alloc(parser, PACKET_BUF_HEADROOM + data_len,
+                                   type);
+    return buf ? buf + PACKET_BUF_HEADROOM : NULL;
+}
+
+void usbredirparser_free_packet_buffer(struct usbredirparser *parser_pub,
+    uint8_t *data)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    if (data)
+        usbredirparser_mem_free(parser, data - PACKET_BUF_HEADROOM);
+}
+
+uint8_t *usbredirparser_take_packet_data(struct usbredirparser *parser_pub,
+    uint8_t *data, int data_len)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    uint8_t *buf;
+
+    if (!data)
+        return NULL;
+
+    /* If the data is in a buffer of our own, hand that over */
+    if (data == parser->data && !parser->data_placed &&
+            !parser->data_borrowed) {
+        parser->data = NULL;
+        return data;
+    }
+
+    buf = usbredirparser_mem_alloc(parser, data_len, parser->header.type);
+    if (!buf)
+        return NULL;
+    memcpy(buf, data, data_len);
+    return buf;
+}
+
+void usbredirparser_get_pool_stats(struct usbredirparser *parser_pub,
+    struct usbredirparser_pool_stats *stats)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    int c;
+
+    POOL_LOCK(parser);
+    stats->hits = parser->pool_hits;
+    stats->misses = parser->pool_misses;
+    stats->overflows = parser->pool_overflows;
+    stats->cached = 0;
+    for (c = 0; c < POOL_CLASSES; c++)
+        stats->cached += parser->pool_count[c];
+    POOL_UNLOCK(parser);
+}
+
+/* Returns the endpoint type whose ttl applies to a packet being send, or -1
+   if the packet never expires, see usbredirparser_set_packet_ttl */
+static int usbredirparser_get_ttl_ep_type(uint32_t type, void *type_header)
+{
+    uint8_t ep;
+
+    switch (type) {
+    case usb_redir_iso_packet:
+        ep = ((struct usb_redir_iso_packet_header *)type_header)->endpoint;
+        return (ep & 0x80) ? usb_redir_type_iso : -1;
+    case usb_redir_multi_iso_packet:
+        ep = ((struct usb_redir_multi_iso_packet_header *)
+              type_header)->endpoint;
+        return (ep & 0x80) ? usb_redir_type_iso : -1;
+    case usb_redir_interrupt_packet:
+        ep = ((struct usb_redir_interrupt_packet_header *)
+              type_header)->endpoint;
+        return (ep & 0x80) ? usb_redir_type_interrupt : -1;
+    default:
+        return -1;
+    }
+}
+
+static void usbredirparser_queue_append(struct usbredirparser_priv *parser,
+    uint8_t *buf, int pos, int len, uint32_t type, void *type_header)
+{
+    struct usbredirparser *parser_pub = (struct usbredirparser *)parser;
+    int r, watermark = -1;
+
+    LOCK(parser);
+    if (usbredirparser_using_compact_header(parser_pub)) {
+        pos = usbredirparser_compact_header(parser_pub, buf, pos);
+        /* The write callback frees the buffers passed to it, so the packet
+           must start at the start of the buffer */
+        if (parser->flags & usbredirparser_fl_write_cb_owns_buffer) {
+            memmove(buf, buf + pos, len - pos);
+            len -= pos;
+            pos = 0;
+        }
+    }
+    r = usbredirparser_write_buf_append(parser, buf, pos, len, type,
+                            usbredirparser_get_id_slot(type, type_header),
+                            usbredirparser_get_ttl_ep_type(type, type_header));
+    if (r == 0)
+        watermark = usbredirparser_check_watermarks(parser);
+    UNLOCK(parser);
+    if (r) {
+        ERROR("Out of memory allocating buffer to send packet, dropping!");
+        usbredirparser_mem_free(parser, buf);
+    }
+    usbredirparser_call_watermark_func(parser, watermark);
 }
 
 static void usbredirparser_queue(struct usbredirparser *parser_pub,
@@ -1084,8 +3114,7 @@ static void usbredirparser_queue(struct usbredirparser *parser_pub,
         (struct usbredirparser_priv *)parser_pub;
     uint8_t *buf, *type_header_out, *data_out;
     struct usb_redir_header *header;
-    struct usbredirparser_buf *wbuf, *new_wbuf;
-    int header_len, type_header_len;
+    int header_len, type_header_len, compressed_len;
 
     header_len = usbredirparser_get_header_len(parser_pub);
     type_header_len = usbredirparser_get_type_header_len(parser_pub, type, 1);
@@ -1100,21 +3129,29 @@ static void usbredirparser_queue(struct usbredirparser *parser_pub,
         return;
     }
 
-    new_wbuf = calloc(1, sizeof(*new_wbuf));
-    buf = malloc(header_len + type_header_len + data_len);
-    if (!new_wbuf || !buf) {
+    buf = usbredirparser_mem_alloc(parser,
+                                   header_len + type_header_len + data_len,
+                                   type);
+    if (!buf) {
         ERROR("Out of memory allocating buffer to send packet, dropping!");
-        free(new_wbuf); free(buf);
         return;
     }
 
-    new_wbuf->buf = buf;
-    new_wbuf->len = header_len + type_header_len + data_len;
-
     header = (struct usb_redir_header *)buf;
     type_header_out = buf + header_len;
     data_out = type_header_out + type_header_len;
 
+    compressed_len = 0;
+    if (usbredirparser_may_compress(parser_pub, type, type_header_in,
+                                    data_len))
+        compressed_len = usbredirparser_compress(parser_pub, type,
+                                                 type_header_in, data_out,
+                                                 data_in, data_len);
+    if (compressed_len)
+        data_len = compressed_len;
+    else
+        memcpy(data_out, data_in, data_len);
+
     header->type   = type;
     header->length = type_header_len + data_len;
     if (usbredirparser_using_32bits_ids(parser_pub))
@@ -1122,21 +3159,87 @@ static void usbredirparser_queue(struct usbredirparser *parser_pub,
     else
         header->id = id;
     memcpy(type_header_out, type_header_in, type_header_len);
-    memcpy(data_out, data_in, data_len);
 
-    LOCK(parser);
-    if (!parser->write_buf) {
-        parser->write_buf = new_wbuf;
-    } else {
-        /* limiting the write_buf's stack depth is our users responsibility */
-        wbuf = parser->write_buf;
-        while (wbuf->next)
-            wbuf = wbuf->next;
+    usbredirparser_queue_append(parser, buf, 0,
+                                header_len + type_header_len + data_len,
+                                type, type_header_in);
+}
+
+/* Like usbredirparser_queue, but for data in a buffer obtained from
+   usbredirparser_alloc_packet_buffer. The headers get written into the
+   headroom in front of the data, so the data itself does not need to be
+   copied. Ownership of the buffer is always passed to the parser. */
+static void usbredirparser_queue_buf(struct usbredirparser *parser_pub,
+    uint32_t type, uint64_t id, void *type_header_in,
+    uint8_t *data, int data_len)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    uint8_t *buf, *type_header_out, *compressed;
+    struct usb_redir_header *header;
+    int header_len, type_header_len, compressed_len, pos;
+
+    /* With fl_write_cb_owns_buffer the write callback frees the buffers
+       passed to it, so these must start at the allocation */
+    if (parser->flags & usbredirparser_fl_write_cb_owns_buffer) {
+        usbredirparser_queue(parser_pub, type, id, type_header_in,
+                             data, data_len);
+        usbredirparser_free_packet_buffer(parser_pub, data);
+        return;
+    }
 
-        wbuf->next = new_wbuf;
+    header_len = usbredirparser_get_header_len(parser_pub);
+    type_header_len = usbredirparser_get_type_header_len(parser_pub, type, 1);
+    if (type_header_len < 0 ||
+            header_len + type_header_len > PACKET_BUF_HEADROOM) {
+        /* This should never happen */
+        ERROR("error packet type unknown with internal call, please report!!");
+        usbredirparser_free_packet_buffer(parser_pub, data);
+        return;
     }
-    parser->write_buf_count++;
-    UNLOCK(parser);
+
+    if (!usbredirparser_verify_type_header(parser_pub, type, type_header_in,
+                                           data, data_len, 1)) {
+        ERROR("error usbredirparser_send_* call invalid params, please report!!");
+        usbredirparser_free_packet_buffer(parser_pub, data);
+        return;
+    }
+
+    if (usbredirparser_may_compress(parser_pub, type, type_header_in,
+                                    data_len)) {
+        compressed = usbredirparser_alloc_packet_buffer(parser_pub, type,
+                                                        data_len);
+        compressed_len = 0;
+        if (compressed)
+            compressed_len = usbredirparser_compress(parser_pub, type,
+                                                     type_header_in,
+                                                     compressed, data,
+                                                     data_len);
+        if (compressed_len) {
+            usbredirparser_free_packet_buffer(parser_pub, data);
+            data = compressed;
+            data_len = compressed_len;
+        } else {
+            usbredirparser_free_packet_buffer(parser_pub, compressed);
+        }
+    }
+
+    buf = data - PACKET_BUF_HEADROOM;
+    pos = PACKET_BUF_HEADROOM - header_len - type_header_len;
+    header = (struct usb_redir_header *)(buf + pos);
+    type_header_out = buf + pos + header_len;
+
+    header->type   = type;
+    header->length = type_header_len + data_len;
+    if (usbredirparser_using_32bits_ids(parser_pub))
+        ((struct usb_redir_header_32bit_id *)header)->id = id;
+    else
+        header->id = id;
+    memcpy(type_header_out, type_header_in, type_header_len);
+
+    usbredirparser_queue_append(parser, buf, pos,
+                                PACKET_BUF_HEADROOM + data_len,
+                                type, type_header_in);
 }
 
 void usbredirparser_send_device_connect(struct usbredirparser *parser,
@@ -1348,6 +3451,14 @@ void usbredirparser_send_bulk_receiving_status(struct usbredirparser *parser,
                          bulk_receiving_status, NULL, 0);
 }
 
+void usbredirparser_send_ep_credits(struct usbredirparser *parser,
+    uint64_t id,
+    struct usb_redir_ep_credits_header *ep_credits)
+{
+    usbredirparser_queue(parser, usb_redir_ep_credits, id, ep_credits,
+                         NULL, 0);
+}
+
 /* Data packets: */
 void usbredirparser_send_control_packet(struct usbredirparser *parser,
     uint64_t id,
@@ -1394,6 +3505,69 @@ void usbredirparser_send_buffered_bulk_packet(struct usbredirparser *parser,
                          buffered_bulk_header, data, data_len);
 }
 
+void usbredirparser_send_multi_iso_packet(struct usbredirparser *parser,
+    uint64_t id,
+    struct usb_redir_multi_iso_packet_header *multi_iso_header,
+    uint8_t *data, int data_len)
+{
+    usbredirparser_queue(parser, usb_redir_multi_iso_packet, id,
+                         multi_iso_header, data, data_len);
+}
+
+void usbredirparser_send_control_packet_buf(struct usbredirparser *parser,
+    uint64_t id,
+    struct usb_redir_control_packet_header *control_header,
+    uint8_t *data, int data_len)
+{
+    usbredirparser_queue_buf(parser, usb_redir_control_packet, id,
+                             control_header, data, data_len);
+}
+
+void usbredirparser_send_bulk_packet_buf(struct usbredirparser *parser,
+    uint64_t id,
+    struct usb_redir_bulk_packet_header *bulk_header,
+    uint8_t *data, int data_len)
+{
+    usbredirparser_queue_buf(parser, usb_redir_bulk_packet, id, bulk_header,
+                             data, data_len);
+}
+
+void usbredirparser_send_iso_packet_buf(struct usbredirparser *parser,
+    uint64_t id,
+    struct usb_redir_iso_packet_header *iso_header,
+    uint8_t *data, int data_len)
+{
+    usbredirparser_queue_buf(parser, usb_redir_iso_packet, id, iso_header,
+                             data, data_len);
+}
+
+void usbredirparser_send_interrupt_packet_buf(struct usbredirparser *parser,
+    uint64_t id,
+    struct usb_redir_interrupt_packet_header *interrupt_header,
+    uint8_t *data, int data_len)
+{
+    usbredirparser_queue_buf(parser, usb_redir_interrupt_packet, id,
+                             interrupt_header, data, data_len);
+}
+
+void usbredirparser_send_buffered_bulk_packet_buf(
+    struct usbredirparser *parser, uint64_t id,
+    struct usb_redir_buffered_bulk_packet_header *buffered_bulk_header,
+    uint8_t *data, int data_len)
+{
+    usbredirparser_queue_buf(parser, usb_redir_buffered_bulk_packet, id,
+                             buffered_bulk_header, data, data_len);
+}
+
+void usbredirparser_send_multi_iso_packet_buf(struct usbredirparser *parser,
+    uint64_t id,
+    struct usb_redir_multi_iso_packet_header *multi_iso_header,
+    uint8_t *data, int data_len)
+{
+    usbredirparser_queue_buf(parser, usb_redir_multi_iso_packet, id,
+                             multi_iso_header, data, data_len);
+}
+
 /****** Serialization support ******/
 
 #define USBREDIRPARSER_SERIALIZE_MAGIC        0x55525031
@@ -1409,6 +3583,14 @@ void usbredirparser_send_buffered_bulk_packet(struct usbredirparser *parser,
     uint32 to_skip
     uint32 header_read
     uint8  header[header_read]
+    When using compact headers, header contains the compact header, and it
+    is followed by:
+    uint32 send_ids_len
+    uint64 send_ids[send_ids_len / 8]
+    uint32 recv_ids_len
+    uint64 recv_ids[recv_ids_len / 8]
+    uint32 id_len
+    uint64 id
     uint32 type_header_read
     uint8  type_header[type_header_read]
     uint32 data_read
@@ -1416,6 +3598,10 @@ void usbredirparser_send_buffered_bulk_packet(struct usbredirparser *parser,
     uint32 write_buf_count: followed by write_buf_count times:
         uint32 write_buf_len
         uint8  write_buf_data[write_buf_len]
+    The below is optional, it is only present when there is received data
+    which has not been parsed yet:
+    uint32 read_buf_len
+    uint8  read_buf[read_buf_len]
 */
 
 static int serialize_alloc(struct usbredirparser_priv *parser,
@@ -1524,7 +3710,7 @@ static int unserialize_data(struct usbredirparser_priv *parser,
         return -1;
     }
     if (*data == NULL && len > 0) {
-        *data = malloc(len);
+        *data = usbredirparser_mem_alloc(parser, len, -1);
         if (!*data) {
             ERROR("Out of memory allocating unserialize buffer");
             return -1;
@@ -1555,13 +3741,22 @@ int usbredirparser_serialize(struct usbredirparser *parser_pub,
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
+    struct usbredirparser_wqueue *q;
     struct usbredirparser_buf *wbuf;
-    uint8_t *write_buf_count_pos, *state = NULL, *pos = NULL;
-    uint32_t write_buf_count = 0, len, remain = 0;
+    uint8_t *state = NULL, *pos = NULL;
+    uint32_t len, remain = 0;
+    int i, j, slot, next[COMPACT_ID_SLOTS] = { 0 };
+    uint64_t seq;
 
     *state_dest = NULL;
     *state_len = 0;
 
+    /* The state does not cover the chunks already passed to the app */
+    if (parser->data_chunked) {
+        ERROR("error can not serialize while receiving a chunked bulk packet");
+        return -1;
+    }
+
     if (serialize_int(parser, &state, &pos, &remain,
                                    USBREDIRPARSER_SERIALIZE_MAGIC, "magic"))
         return -1;
@@ -1588,10 +3783,29 @@ int usbredirparser_serialize(struct usbredirparser *parser_pub,
     if (serialize_int(parser, &state, &pos, &remain, parser->to_skip, "skip"))
         return -1;
 
-    if (serialize_data(parser, &state, &pos, &remain,
-                       (uint8_t *)&parser->header, parser->header_read,
-                       "header"))
-        return -1;
+    if (usbredirparser_using_compact_header(parser_pub)) {
+        if (serialize_data(parser, &state, &pos, &remain,
+                           parser->compact_header, parser->header_read,
+                           "header"))
+            return -1;
+        if (serialize_data(parser, &state, &pos, &remain,
+                           (uint8_t *)parser->send_ids,
+                           sizeof(parser->send_ids), "send_ids"))
+            return -1;
+        if (serialize_data(parser, &state, &pos, &remain,
+                           (uint8_t *)parser->recv_ids,
+                           sizeof(parser->recv_ids), "recv_ids"))
+            return -1;
+        if (serialize_data(parser, &state, &pos, &remain,
+                           (uint8_t *)&parser->header.id,
+                           sizeof(parser->header.id), "id"))
+            return -1;
+    } else {
+        if (serialize_data(parser, &state, &pos, &remain,
+                           (uint8_t *)&parser->header, parser->header_read,
+                           "header"))
+            return -1;
+    }
 
     if (serialize_data(parser, &state, &pos, &remain,
                        parser->type_header, parser->type_header_read,
@@ -1602,22 +3816,45 @@ int usbredirparser_serialize(struct usbredirparser *parser_pub,
                        parser->data, parser->data_read, "packet-data"))
         return -1;
 
-    write_buf_count_pos = pos;
-    /* To be replaced with write_buf_count later */
-    if (serialize_int(parser, &state, &pos, &remain, 0, "write_buf_count"))
+    if (serialize_int(parser, &state, &pos, &remain,
+                      parser->write_queue.count + parser->slot_queued,
+                      "write_buf_count"))
         return -1;
 
-    wbuf = parser->write_buf;
-    while (wbuf) {
+    /* The write queue first, as it holds the oldest packets of each slot
+       and its head may have been partially written already. Then the slot
+       queues in the order in which their packets were queued, so that the
+       unserialized packets still respect the barriers, see
+       usbredirparser_next_write_slot */
+    for (i = 0; i < parser->write_queue.count + parser->slot_queued; i++) {
+        if (i < parser->write_queue.count) {
+            wbuf = WBUF(parser, i);
+        } else {
+            slot = -1;
+            seq = 0;
+            for (j = 0; j < COMPACT_ID_SLOTS; j++) {
+                q = &parser->slot_queue[j];
+                if (next[j] < q->count &&
+                        (slot == -1 || WQBUF(q, next[j])->seq < seq)) {
+                    slot = j;
+                    seq = WQBUF(q, next[j])->seq;
+                }
+            }
+            wbuf = WQBUF(&parser->slot_queue[slot], next[slot]++);
+        }
         if (serialize_data(parser, &state, &pos, &remain,
                            wbuf->buf + wbuf->pos, wbuf->len - wbuf->pos,
                            "write-buf"))
             return -1;
-        write_buf_count++;
-        wbuf = wbuf->next;
     }
-    /* Patch in write_buf_count */
-    memcpy(write_buf_count_pos, &write_buf_count, sizeof(int32_t));
+
+    if (parser->read_buf_len - parser->read_buf_pos) {
+        if (serialize_data(parser, &state, &pos, &remain,
+                           parser->read_buf + parser->read_buf_pos,
+                           parser->read_buf_len - parser->read_buf_pos,
+                           "read-buf"))
+            return -1;
+    }
 
     /* Patch in length */
     len = pos - state;
@@ -1634,7 +3871,6 @@ int usbredirparser_unserialize(struct usbredirparser *parser_pub,
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
-    struct usbredirparser_buf *wbuf, **next;
     uint32_t orig_caps[USB_REDIR_CAPS_SIZE];
     uint8_t *data;
     uint32_t i, l, header_len, remain = len;
@@ -1675,12 +3911,42 @@ int usbredirparser_unserialize(struct usbredirparser *parser_pub,
         return -1;
     parser->to_skip = i;
 
-    header_len = usbredirparser_get_header_len(parser_pub);
-    data = (uint8_t *)&parser->header;
-    i = header_len;
-    if (unserialize_data(parser, &state, &remain, &data, &i, "header"))
-        return -1;
-    parser->header_read = i;
+    if (usbredirparser_using_compact_header(parser_pub)) {
+        data = parser->compact_header;
+        i = sizeof(parser->compact_header);
+        if (unserialize_data(parser, &state, &remain, &data, &i, "header"))
+            return -1;
+        parser->header_read = i;
+        if (usbredirparser_decode_compact_header(parser) < 0) {
+            ERROR("error unserialize packet header invalid");
+            return -1;
+        }
+        header_len = usbredirparser_get_read_header_len(parser_pub);
+
+        data = (uint8_t *)parser->send_ids;
+        i = sizeof(parser->send_ids);
+        if (unserialize_data(parser, &state, &remain, &data, &i, "send_ids"))
+            return -1;
+        data = (uint8_t *)parser->recv_ids;
+        l = sizeof(parser->recv_ids);
+        if (unserialize_data(parser, &state, &remain, &data, &l, "recv_ids"))
+            return -1;
+        if (i != sizeof(parser->send_ids) || l != sizeof(parser->recv_ids)) {
+            ERROR("error unserialize id tables size mismatch");
+            return -1;
+        }
+        data = (uint8_t *)&parser->header.id;
+        i = sizeof(parser->header.id);
+        if (unserialize_data(parser, &state, &remain, &data, &i, "id"))
+            return -1;
+    } else {
+        header_len = usbredirparser_get_header_len(parser_pub);
+        data = (uint8_t *)&parser->header;
+        i = header_len;
+        if (unserialize_data(parser, &state, &remain, &data, &i, "header"))
+            return -1;
+        parser->header_read = i;
+    }
 
     /* Set various length field froms the header (if we've a header) */
     if (parser->header_read == header_len) {
@@ -1706,7 +3972,8 @@ int usbredirparser_unserialize(struct usbredirparser *parser_pub,
     parser->type_header_read = i;
 
     if (parser->data_len) {
-        parser->data = malloc(parser->data_len);
+        parser->data = usbredirparser_mem_alloc(parser, parser->data_len,
+                                                parser->header.type);
         if (!parser->data) {
             ERROR("Out of memory allocating unserialize buffer");
             return -1;
@@ -1720,22 +3987,36 @@ int usbredirparser_unserialize(struct usbredirparser *parser_pub,
     /* Get the write buffer count and the write buffers */
     if (unserialize_int(parser, &state, &remain, &i, "write_buf_count"))
         return -1;
-    next = &parser->write_buf;
     while (i) {
-        wbuf = calloc(1, sizeof(*wbuf));
-        if (!wbuf) {
+        data = NULL;
+        l = 0;
+        if (unserialize_data(parser, &state, &remain, &data, &l, "wbuf"))
+            return -1;
+        if (usbredirparser_write_buf_append(parser, data, 0, l, -1, -1, -1)) {
             ERROR("Out of memory allocating unserialize buffer");
+            usbredirparser_mem_free(parser, data);
             return -1;
         }
-        *next = wbuf;
-        l = 0;
-        if (unserialize_data(parser, &state, &remain, &wbuf->buf, &l, "wbuf"))
-            return -1;
-        wbuf->len = l;
-        next = &wbuf->next;
         i--;
     }
 
+    if (remain) {
+        if (!parser->read_buf) {
+            parser->read_buf = usbredirparser_mem_alloc(parser, READ_BUF_SIZE,
+                                                        -1);
+            if (!parser->read_buf) {
+                ERROR("Out of memory allocating unserialize buffer");
+                return -1;
+            }
+        }
+        l = READ_BUF_SIZE;
+        if (unserialize_data(parser, &state, &remain, &parser->read_buf, &l,
+                             "read-buf"))
+            return -1;
+        parser->read_buf_pos = 0;
+        parser->read_buf_len = l;
+    }
+
     if (remain) {
         ERROR("error unserialize %d bytes of extraneous state data", remain);
         return -1;
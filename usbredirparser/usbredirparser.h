@@ -21,12 +21,21 @@
 #ifndef __USBREDIRPARSER_H
 #define __USBREDIRPARSER_H
 
+#include <stddef.h>
 #include "usbredirproto.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Buffer description passed to usbredirparser_writev, this has the same
+   layout as the POSIX struct iovec, so on POSIX systems an array of these
+   can be cast to a struct iovec array and handed to writev() directly */
+struct usbredirparser_iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+
 struct usbredirparser;
 struct usbredirfilter_rule;
 
@@ -51,12 +60,67 @@ typedef void (*usbredirparser_log)(void *priv, int level, const char *msg);
 typedef int (*usbredirparser_read)(void *priv, uint8_t *data, int count);
 typedef int (*usbredirparser_write)(void *priv, uint8_t *data, int count);
 
+/* Optional vectored version of usbredirparser_write, if set
+   usbredirparser_do_write will use this instead of write_func, passing
+   (the remaining parts of) as many queued packets as possible in a single
+   call. Must return the total amount of bytes written, 0 when the write
+   would block and -1 on error, just like usbredirparser_write.
+
+   With the usbredirparser_fl_write_cb_owns_buffer flag the callback becomes
+   the owner of each buffer it has written and must free them by calling
+   usbredirparser_free_write_buffer(). In this case it must write a whole
+   number of buffers (it may write fewer than iovcnt buffers), returning
+   any other value will result in a call to abort(). */
+typedef int (*usbredirparser_writev)(void *priv,
+    const struct usbredirparser_iovec *iov, int iovcnt);
+
+/* Called when the amount of bytes queued for writing rises to the high
+   watermark (high = 1), or drops back to the low watermark (high = 0),
+   see usbredirparser_set_write_watermarks. This gets called without holding
+   the parser lock, from the thread queueing a packet or from the thread
+   calling usbredirparser_do_write. Calls are never made concurrently, and
+   always alternate between high = 1 and high = 0, the last call reflecting
+   the current state. */
+typedef void (*usbredirparser_write_watermark)(void *priv, int high);
+
+/* Called when the headers of a received data packet have been parsed, before
+   its data gets stored. type is the usb_redir packet type and type_header
+   points to its (not yet validated) type specific header. The app may return
+   a pointer to data_len bytes of its own memory, for example an usb transfer
+   buffer, to have the data stored there directly, or NULL to have the parser
+   allocate a data buffer as usual.
+
+   If the app places the data, the data packet callback gets this pointer
+   passed as data, and it must not be freed with
+   usbredirparser_free_packet_data. This callback is only used when all of the
+   packet's data has already been received, so the data packet callback is
+   called before usbredirparser_do_read / usbredirparser_feed returns (unless
+   the packet turns out to be invalid, in which case the data packet callback
+   does not get called at all). */
+typedef uint8_t *(*usbredirparser_place_packet_data)(void *priv,
+    uint64_t id, int type, void *type_header, int data_len);
+
 /* Locking functions for use by multithread apps */
 typedef void *(*usbredirparser_alloc_lock)(void);
 typedef void (*usbredirparser_lock)(void *lock);
 typedef void (*usbredirparser_unlock)(void *lock);
 typedef void (*usbredirparser_free_lock)(void *lock);
 
+/* Memory allocation functions for apps which want to use their own allocator
+   (ie a per connection arena) for packet data and write buffers.
+   size is the amount of bytes needed, type is the usb_redir packet type the
+   memory is for, or -1 for internal bookkeeping, these may be used as hints.
+   The alloc and realloc functions must return NULL on failure.
+   Note either all 3 of alloc_mem_func, realloc_mem_func and free_mem_func
+   must be set or none, if none are set the parser uses malloc, or its own
+   buffer pool with the usbredirparser_fl_buffer_pool flag (see
+   usbredirparser_get_pool_stats). These must be set before calling
+   usbredirparser_init. */
+typedef void *(*usbredirparser_alloc_mem)(void *priv, size_t size, int type);
+typedef void *(*usbredirparser_realloc_mem)(void *priv, void *ptr,
+    size_t size, int type);
+typedef void (*usbredirparser_free_mem)(void *priv, void *ptr);
+
 /* The below callbacks are called when a complete packet of the relevant
    type has been received.
 
@@ -115,12 +179,21 @@ typedef void (*usbredirparser_stop_bulk_receiving)(void *priv,
     uint64_t id, struct usb_redir_stop_bulk_receiving_header *stop_bulk_receiving);
 typedef void (*usbredirparser_bulk_receiving_status)(void *priv,
     uint64_t id, struct usb_redir_bulk_receiving_status_header *bulk_receiving_status);
+typedef void (*usbredirparser_ep_credits)(void *priv,
+    uint64_t id, struct usb_redir_ep_credits_header *ep_credits);
 
 /* Data packets:
 
    Note that ownership of the the data buffer (if not NULL) is passed on to
    the callback. The callback should free it by calling
-   usbredirparser_free_packet_data when it is done with it. */
+   usbredirparser_free_packet_data when it is done with it.
+
+   Unless the parser was initialized with the
+   usbredirparser_fl_borrow_packet_data flag, in that case the data is only
+   lent to the callback, it is only valid for the duration of the callback
+   and it must not be modified or freed. Small packets then get passed
+   straight from the parser's receive buffer, without allocating and copying
+   their data. Use usbredirparser_take_packet_data to keep the data. */
 typedef void (*usbredirparser_control_packet)(void *priv,
     uint64_t id, struct usb_redir_control_packet_header *control_header,
     uint8_t *data, int data_len);
@@ -136,6 +209,37 @@ typedef void (*usbredirparser_interrupt_packet)(void *priv,
 typedef void (*usbredirparser_buffered_bulk_packet)(void *priv, uint64_t id,
     struct usb_redir_buffered_bulk_packet_header *buffered_bulk_header,
     uint8_t *data, int data_len);
+/* The data of a multi iso packet consists of multi_iso_header->packet_count
+   usb_redir_multi_iso_packet_desc-s followed by the data of the packets,
+   which the parser has verified to add up. The packets have ids id to
+   id + packet_count - 1. These only get sent to apps which pass
+   usb_redir_cap_multi_iso_packets to usbredirparser_init. If this callback
+   is not set the parser passes the packets to iso_packet_func one by one
+   instead, so apps can set the cap without handling them themselves. */
+typedef void (*usbredirparser_multi_iso_packet)(void *priv, uint64_t id,
+    struct usb_redir_multi_iso_packet_header *multi_iso_header,
+    uint8_t *data, int data_len);
+
+/* Bulk packets with more than USBREDIRPARSER_BULK_CHUNK_SIZE bytes of data
+   get passed to this callback (if set) in chunks of at most
+   USBREDIRPARSER_BULK_CHUNK_SIZE bytes, rather than to bulk_packet_func,
+   as soon as each chunk has been received. This avoids having to buffer
+   the whole packet, which may be up to 4GB in size with the
+   usb_redir_cap_32bits_bulk_length capability.
+
+   offset is the offset of the chunk's data within the packet, and last is 1
+   for the last chunk of the packet. The headers are validated before the
+   first chunk gets passed. If the parser runs out of memory halfway
+   through a packet, the rest of the packet is skipped, and the callback gets
+   called one final time with data NULL, data_len 0 and last 1.
+
+   Ownership of the data works the same as for the other data packet
+   callbacks. Note that a parser can not be serialized while it is halfway
+   through receiving a chunked bulk packet. */
+#define USBREDIRPARSER_BULK_CHUNK_SIZE (256 * 1024)
+typedef void (*usbredirparser_bulk_packet_chunk)(void *priv, uint64_t id,
+    struct usb_redir_bulk_packet_header *bulk_header,
+    uint8_t *data, int data_len, int offset, int last);
 
 
 /* Public part of the data allocated by usbredirparser_alloc, *never* allocate
@@ -194,6 +298,22 @@ struct usbredirparser {
     usbredirparser_bulk_receiving_status bulk_receiving_status_func;
     /* usbredir 0.6 new data packet complete callbacks */
     usbredirparser_buffered_bulk_packet buffered_bulk_packet_func;
+    /* usbredir 0.7 new non packet callbacks (for custom memory allocation) */
+    usbredirparser_alloc_mem alloc_mem_func;
+    usbredirparser_realloc_mem realloc_mem_func;
+    usbredirparser_free_mem free_mem_func;
+    /* usbredir 0.7 new non packet callbacks (for vectored writes) */
+    usbredirparser_writev writev_func;
+    /* usbredir 0.7 new non packet callbacks (for write flow control) */
+    usbredirparser_write_watermark write_watermark_func;
+    /* usbredir 0.7 new non packet callbacks (for zero-copy receiving) */
+    usbredirparser_place_packet_data place_packet_data_func;
+    /* usbredir 0.7 new data packet callbacks (for chunked bulk packets) */
+    usbredirparser_bulk_packet_chunk bulk_packet_chunk_func;
+    /* usbredir 0.7 new data packet complete callbacks */
+    usbredirparser_multi_iso_packet multi_iso_packet_func;
+    /* usbredir 0.7 new control packet complete callbacks */
+    usbredirparser_ep_credits ep_credits_func;
 };
 
 /* Allocate a usbredirparser, after this the app should set the callback app
@@ -208,11 +328,20 @@ void usbredirparser_caps_set_cap(uint32_t *caps, int cap);
 
 /* Init the parser, this will queue an initial usb_redir_hello packet,
    sending the version and caps to the peer, as well as configure the parsing
-   according to the passed in flags. */
+   according to the passed in flags.
+
+   With the usbredirparser_fl_buffer_pool flag packet data and write buffers
+   come from a per parser pool, see usbredirparser_get_pool_stats. The pool
+   is freed by usbredirparser_destroy, so all buffers obtained from the
+   parser (packet data, write buffers with
+   usbredirparser_fl_write_cb_owns_buffer and packet buffers) must be freed
+   before destroying the parser when using this flag. */
 enum {
     usbredirparser_fl_usb_host = 0x01,
     usbredirparser_fl_write_cb_owns_buffer = 0x02,
     usbredirparser_fl_no_hello = 0x04,
+    usbredirparser_fl_borrow_packet_data = 0x08,
+    usbredirparser_fl_buffer_pool = 0x10,
 };
 
 void usbredirparser_init(struct usbredirparser *parser,
@@ -241,18 +370,93 @@ enum {
 };
 int usbredirparser_do_read(struct usbredirparser *parser);
 
+/* Alternative to usbredirparser_do_read for apps which do their own
+   reading from the transport, this parses len bytes of data from buf,
+   which remains owned by the caller. Packets may be split over multiple
+   calls in any way, incomplete packets are buffered by the parser.
+
+   Returns 0 on success, in which case all len bytes have been consumed, or
+   one of the usbredirparser_read_* errors. *consumed is set to the number of
+   bytes of buf consumed, also on error. After a
+   usbredirparser_read_parse_error the faulty packet will be skipped (*) and
+   the app may continue by feeding the not consumed bytes. Data left over
+   from usbredirparser_do_read or usbredirparser_unserialize gets parsed
+   before buf, if an error happens there *consumed is 0.
+   *) As determined by the faulty's package headers length field
+
+   When using this function, the read_func callback does not need to be
+   set. Both ways of feeding the parser may be mixed. */
+int usbredirparser_feed(struct usbredirparser *parser,
+    const uint8_t *buf, size_t len, size_t *consumed);
+
 /* This returns the number of usbredir packets queued up for writing */
 int usbredirparser_has_data_to_write(struct usbredirparser *parser);
 
 /* Call this when usbredirparser_has_data_to_write returns > 0
    returns 0 on success, -1 if a write error happened.
    If a write error happened, this function will retry writing any queued data
-   on the next call, and will continue doing so until it has succeeded! */
+   on the next call, and will continue doing so until it has succeeded!
+   Packets are written in the order they were queued per endpoint, but not
+   between endpoints: control and status packets go before any queued data
+   packets, and the endpoints with data packets queued take turns, see
+   usbredirparser_set_write_weight. */
 enum {
     usbredirparser_write_io_error   = -1,
 };
 int usbredirparser_do_write(struct usbredirparser *parser);
 
+/* Between usbredirparser_begin_batch and usbredirparser_end_batch
+   usbredirparser_do_write does not write anything, so that the packets
+   sent meanwhile get written together once the outermost batch ends (in a
+   single writev_func call if possible). Batches may be nested. The app
+   should call usbredirparser_do_write after ending the batch. */
+void usbredirparser_begin_batch(struct usbredirparser *parser);
+void usbredirparser_end_batch(struct usbredirparser *parser);
+
+/* This returns the number of bytes queued for writing */
+uint64_t usbredirparser_get_write_buf_bytes(struct usbredirparser *parser);
+
+/* This returns how long (in microseconds) the oldest packet queued for
+   writing has been waiting, or 0 if nothing is queued */
+uint64_t usbredirparser_get_write_buf_age(struct usbredirparser *parser);
+
+/* Set the high and low watermarks (in bytes queued for writing) at which the
+   write_watermark_func gets called. Passing a high watermark of 0 disables
+   this (the default). low should be smaller than high. */
+void usbredirparser_set_write_watermarks(struct usbredirparser *parser,
+    uint64_t high, uint64_t low);
+
+/* Set a time to live (in microseconds) for input stream data packets queued
+   for writing, for endpoints of type ep_type (usb_redir_type_iso or
+   usb_redir_type_interrupt). Packets which have been queued for longer than
+   this when it is their turn to be written get dropped by
+   usbredirparser_do_write instead. 0 disables this (the default).
+   Other packets, such as control / bulk packets and status packets, never
+   expire. */
+void usbredirparser_set_packet_ttl(struct usbredirparser *parser,
+    int ep_type, uint32_t ttl);
+
+/* This returns the number of packets for endpoints of type ep_type which
+   got dropped because their time to live expired */
+uint64_t usbredirparser_get_expired_packets(struct usbredirparser *parser,
+    int ep_type);
+
+/* Drop packets of packet type type for endpoint ep, which are queued for
+   writing but have not been (partially) written yet. This can be used to
+   not send input stream data the peer no longer wants, type must be one of
+   usb_redir_iso_packet, usb_redir_multi_iso_packet,
+   usb_redir_interrupt_packet or usb_redir_buffered_bulk_packet.
+   Returns the number of packets dropped. */
+int usbredirparser_purge_write_queue(struct usbredirparser *parser,
+    int type, uint8_t ep);
+
+/* Set the share of the connection the data packets queued for endpoint ep
+   get when multiple endpoints have data queued for writing. Endpoints get
+   to send up to weight * 16 KiB of data per turn, weight must be between 1
+   (the default) and 256. */
+void usbredirparser_set_write_weight(struct usbredirparser *parser,
+    uint8_t ep, int weight);
+
 /* See usbredirparser_write documentation */
 void usbredirparser_free_write_buffer(struct usbredirparser *parser,
     uint8_t *data);
@@ -261,6 +465,67 @@ void usbredirparser_free_write_buffer(struct usbredirparser *parser,
 void usbredirparser_free_packet_data(struct usbredirparser *parser,
     uint8_t *data);
 
+/* Only for use from data packet callbacks with the
+   usbredirparser_fl_borrow_packet_data flag. Takes ownership of the data
+   passed to the callback, returning a buffer holding the data which must be
+   freed with usbredirparser_free_packet_data. This only copies the data if
+   it is not already in a buffer of its own. Returns NULL if data is NULL
+   or when out of memory. */
+uint8_t *usbredirparser_take_packet_data(struct usbredirparser *parser,
+    uint8_t *data, int data_len);
+
+/* Allocate a buffer for packet data of the given usb_redir packet type,
+   using the same allocator as the parser uses for received packet data.
+   Buffers allocated this way must be freed with
+   usbredirparser_free_packet_data. Returns NULL when out of memory. */
+uint8_t *usbredirparser_alloc_packet_data(struct usbredirparser *parser,
+    int type, int len);
+
+/* Allocate a buffer for data_len bytes of packet data of the given
+   usb_redir packet type, with room for the packet headers reserved in front
+   of it. The returned pointer points to the data part, it can be filled
+   (for example by using it as an usb transfer buffer) and then be passed to
+   one of the usbredirparser_send_*_buf functions, which take ownership of
+   it. Buffers which do not get send must be freed with
+   usbredirparser_free_packet_buffer. Returns NULL when out of memory. */
+uint8_t *usbredirparser_alloc_packet_buffer(struct usbredirparser *parser,
+    int type, int data_len);
+void usbredirparser_free_packet_buffer(struct usbredirparser *parser,
+    uint8_t *data);
+
+/* With the usbredirparser_fl_buffer_pool flag, and when the app has not set
+   its own memory allocation functions, packet data and write buffers come
+   from a per parser pool of free buffers, with size classes for common
+   packet sizes. This returns the pool's statistics. */
+struct usbredirparser_pool_stats {
+    uint64_t hits;      /* Allocations served from the pool */
+    uint64_t misses;    /* Allocations which needed malloc */
+    uint64_t overflows; /* Frees which went to free() since the pool was full
+                           or the buffer too large */
+    int cached;         /* Number of free buffers currently in the pool */
+};
+void usbredirparser_get_pool_stats(struct usbredirparser *parser,
+    struct usbredirparser_pool_stats *stats);
+
+/* When both sides have the usb_redir_cap_compression capability, the data of
+   large enough bulk and buffered bulk packets gets send zlib compressed,
+   unless it does not compress well. Endpoints whose data repeatedly does
+   not compress well get send raw without trying for a while. The parser
+   only keeps the capability when built with zlib. This returns the
+   compression statistics. */
+struct usbredirparser_compression_stats {
+    uint64_t packets_compressed;   /* Packets send compressed */
+    uint64_t packets_incompressible; /* Packets send raw after trying */
+    uint64_t packets_skipped;      /* Packets send raw without trying */
+    uint64_t bytes_in;             /* Data bytes of the compressed packets */
+    uint64_t bytes_out;            /* Their size after compression */
+    uint64_t compress_usec;        /* Time spent compressing */
+    uint64_t packets_decompressed; /* Compressed packets received */
+    uint64_t decompress_usec;      /* Time spent decompressing */
+};
+void usbredirparser_get_compression_stats(struct usbredirparser *parser,
+    struct usbredirparser_compression_stats *stats);
+
 /* Functions to marshall and queue a packet for sending to its peer. Note:
    1) it will not be actually send until usbredirparser_do_write is called
    2) if their is not enough memory for buffers the packet will be dropped
@@ -335,6 +600,9 @@ void usbredirparser_send_stop_bulk_receiving(struct usbredirparser *parser,
 void usbredirparser_send_bulk_receiving_status(struct usbredirparser *parser,
     uint64_t id,
     struct usb_redir_bulk_receiving_status_header *bulk_receiving_status);
+void usbredirparser_send_ep_credits(struct usbredirparser *parser,
+    uint64_t id,
+    struct usb_redir_ep_credits_header *ep_credits);
 /* Data packets: */
 void usbredirparser_send_control_packet(struct usbredirparser *parser,
     uint64_t id,
@@ -356,6 +624,44 @@ void usbredirparser_send_buffered_bulk_packet(struct usbredirparser *parser,
     uint64_t id,
     struct usb_redir_buffered_bulk_packet_header *buffered_bulk_header,
     uint8_t *data, int data_len);
+/* Only send this to peers with the usb_redir_cap_multi_iso_packets cap, the
+   data must be laid out as described for usbredirparser_multi_iso_packet */
+void usbredirparser_send_multi_iso_packet(struct usbredirparser *parser,
+    uint64_t id,
+    struct usb_redir_multi_iso_packet_header *multi_iso_header,
+    uint8_t *data, int data_len);
+
+/* Zero-copy variants of the data packet send functions. These take a data
+   buffer allocated with usbredirparser_alloc_packet_buffer and queue it
+   without copying the data, the packet headers get written into headroom
+   reserved in front of the data. Ownership of the buffer is passed to the
+   parser, also when the packet gets dropped. Note the data must start at
+   the pointer returned by usbredirparser_alloc_packet_buffer, data_len may
+   be smaller than the allocated length. */
+void usbredirparser_send_control_packet_buf(struct usbredirparser *parser,
+    uint64_t id,
+    struct usb_redir_control_packet_header *control_header,
+    uint8_t *data, int data_len);
+void usbredirparser_send_bulk_packet_buf(struct usbredirparser *parser,
+    uint64_t id,
+    struct usb_redir_bulk_packet_header *bulk_header,
+    uint8_t *data, int data_len);
+void usbredirparser_send_iso_packet_buf(struct usbredirparser *parser,
+    uint64_t id,
+    struct usb_redir_iso_packet_header *iso_header,
+    uint8_t *data, int data_len);
+void usbredirparser_send_interrupt_packet_buf(struct usbredirparser *parser,
+    uint64_t id,
+    struct usb_redir_interrupt_packet_header *interrupt_header,
+    uint8_t *data, int data_len);
+void usbredirparser_send_buffered_bulk_packet_buf(
+    struct usbredirparser *parser, uint64_t id,
+    struct usb_redir_buffered_bulk_packet_header *buffered_bulk_header,
+    uint8_t *data, int data_len);
+void usbredirparser_send_multi_iso_packet_buf(struct usbredirparser *parser,
+    uint64_t id,
+    struct usb_redir_multi_iso_packet_header *multi_iso_header,
+    uint8_t *data, int data_len);
 
 
 /* Serialization */
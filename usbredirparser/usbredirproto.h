@@ -103,6 +103,7 @@ enum {
     usb_redir_start_bulk_receiving,
     usb_redir_stop_bulk_receiving,
     usb_redir_bulk_receiving_status,
+    usb_redir_ep_credits,
 
     /* Data packets */
     usb_redir_control_packet = 100,
@@ -110,6 +111,7 @@ enum {
     usb_redir_iso_packet,
     usb_redir_interrupt_packet,
     usb_redir_buffered_bulk_packet,
+    usb_redir_multi_iso_packet,
 };
 
 enum {
@@ -129,6 +131,14 @@ enum {
     usb_redir_cap_32bits_bulk_length,
     /* Supports bulk receiving / buffered bulk input */
     usb_redir_cap_bulk_receiving,
+    /* Supports usb_redir_multi_iso_packet */
+    usb_redir_cap_multi_iso_packets,
+    /* Supports the compact usb_redir_header encoding */
+    usb_redir_cap_compact_header,
+    /* Supports the usb_redir_ep_credits packet */
+    usb_redir_cap_ep_credits,
+    /* Supports zlib compressed bulk and buffered bulk packet data */
+    usb_redir_cap_compression,
 };
 /* Number of uint32_t-s needed to hold all (known) capabilities */
 #define USB_REDIR_CAPS_SIZE 1
@@ -254,6 +264,11 @@ struct usb_redir_bulk_receiving_status_header {
     uint8_t status;
 } ATTR_PACKED;
 
+struct usb_redir_ep_credits_header {
+    uint8_t endpoint;
+    uint32_t credits;
+} ATTR_PACKED;
+
 struct usb_redir_control_packet_header {
     uint8_t endpoint;
     uint8_t request;
@@ -291,6 +306,19 @@ struct usb_redir_buffered_bulk_packet_header {
     uint8_t status;
 } ATTR_PACKED;
 
+struct usb_redir_multi_iso_packet_header {
+    uint8_t endpoint;
+    uint16_t packet_count;
+    uint32_t length;
+} ATTR_PACKED;
+
+/* The data of an usb_redir_multi_iso_packet starts with packet_count of
+   these, followed by the data of all packets */
+struct usb_redir_multi_iso_packet_desc {
+    uint8_t status;
+    uint16_t length;
+} ATTR_PACKED;
+
 #undef ATTR_PACKED
 
 #if defined(__MINGW32__) || !defined(__GNUC__)
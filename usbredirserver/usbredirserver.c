@@ -34,6 +34,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include "usbredirhost.h"
 
@@ -89,6 +90,24 @@ static int usbredirserver_write(void *priv, uint8_t *data, int count)
     return r;
 }
 
+static int usbredirserver_writev(void *priv,
+    const struct usbredirparser_iovec *iov, int iovcnt)
+{
+    /* usbredirparser_iovec has the same layout as struct iovec */
+    int r = writev(client_fd, (const struct iovec *)iov, iovcnt);
+    if (r < 0) {
+        if (errno == EAGAIN)
+            return 0;
+        if (errno == EPIPE) { /* Client disconnected */
+            close(client_fd);
+            client_fd = -1;
+            return 0;
+        }
+        return -1;
+    }
+    return r;
+}
+
 static void usage(int exit_code, char *argv0)
 {
     fprintf(exit_code? stderr:stdout,
@@ -360,6 +379,7 @@ int main(int argc, char *argv[])
                                  NULL, SERVER_VERSION, verbose, 0);
         if (!host)
             exit(1);
+        usbredirhost_set_writev_func(host, usbredirserver_writev);
         run_main_loop();
         usbredirhost_close(host);
         handle = NULL;